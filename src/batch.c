@@ -0,0 +1,206 @@
+#include <cairo-pdf.h>
+#include <cjson/cJSON.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "batch.h"
+#include "lua.h"
+#include "memo.h"
+#include "render.h"
+#include "traverse.h"
+
+/*
+ * State shared between the worker threads of a batch run. The lock protects
+ * the record stream and the counters.
+ */
+typedef struct batch {
+  pthread_mutex_t lock;
+  FILE *records;
+  const char *outputTemplate;
+  cJSON *stylesheet;
+  options *options;
+  int logMode;
+  unsigned long count;
+  unsigned long rendered;
+  unsigned long failed;
+} batch;
+
+/*
+ * Each worker renders with its own Lua state and its own Cairo surfaces.
+ */
+typedef struct worker {
+  pthread_t thread;
+  lua_State *L;
+  batch *batch;
+} worker;
+
+/*
+ * Expand an output filename template, replacing "%n" with the record number
+ * and "%%" with a percent sign. Returns -1 if the result does not fit.
+ */
+static int expandTemplate(char *out, size_t size, const char *template, unsigned long n) {
+  size_t used = 0;
+  for (const char *p = template; *p; p++) {
+    int written;
+    if (p[0] == '%' && p[1] == 'n') {
+      written = snprintf(out + used, size - used, "%lu", n);
+      p++;
+    } else if (p[0] == '%' && p[1] == '%') {
+      written = snprintf(out + used, size - used, "%%");
+      p++;
+    } else {
+      written = snprintf(out + used, size - used, "%c", *p);
+    }
+    if (written < 0 || used + written >= size) {
+      return -1;
+    }
+    used += written;
+  }
+  return 0;
+}
+
+/*
+ * Pull records off the shared stream one at a time and render each of them to
+ * its own file, until the stream is exhausted.
+ */
+static void *renderRecords(void *arg) {
+  worker *w = arg;
+  batch *b = w->batch;
+  char *line = NULL;
+  size_t capacity = 0;
+
+  while (1) {
+
+    /*
+     * Read the next non-blank record
+     */
+    pthread_mutex_lock(&b->lock);
+    ssize_t length;
+    while ((length = getline(&line, &capacity, b->records)) >= 0) {
+      if (strspn(line, " \t\r\n") != (size_t)length) {
+        break;
+      }
+    }
+    unsigned long n = length >= 0 ? ++b->count : 0;
+    pthread_mutex_unlock(&b->lock);
+    if (length < 0) {
+      break;
+    }
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      length--;
+    }
+
+    int ok = 0;
+    char filename[4096];
+    cJSON *content = cJSON_ParseWithLength(line, length);
+    if (!content) {
+      fprintf(stderr, "Record %lu: invalid JSON.\n", n);
+    } else if (expandTemplate(filename, sizeof(filename), b->outputTemplate, n)) {
+      fprintf(stderr, "Record %lu: output filename is too long.\n", n);
+    } else {
+      unsigned long crc = crc32(0L, Z_NULL, 0);
+      setContentChecksum(crc32(crc, (unsigned char *)line, length));
+      digestRecord(content);
+      if (renderDocument(filename, content, b->stylesheet, w->L, b->options, 1, b->logMode)) {
+        fprintf(stderr, "Record %lu: could not create \"%s\".\n", n, filename);
+      } else {
+        ok = 1;
+      }
+    }
+    digestRecord(NULL);
+    cJSON_Delete(content);
+
+    pthread_mutex_lock(&b->lock);
+    if (ok) {
+      b->rendered++;
+    } else {
+      b->failed++;
+    }
+    pthread_mutex_unlock(&b->lock);
+  }
+
+  free(line);
+  freeRenderCaches();
+  return NULL;
+}
+
+/*
+ * Render every newline-delimited JSON record in a stream as a separate
+ * document, using a single stylesheet that has already been evaluated. The
+ * records are shared out between a pool of worker threads. Returns the exit
+ * status for the program.
+ */
+int renderBatch(FILE *records, const char *outputTemplate, cJSON *stylesheet,
+                options *options, int jobs, int logMode) {
+  if (!strstr(outputTemplate, "%n")) {
+    fprintf(stderr, "The output filename must contain \"%%n\" in batch mode.\n");
+    return EXIT_FAILURE;
+  }
+  if (jobs < 1) {
+    jobs = 1;
+  }
+
+  batch b = {0};
+  pthread_mutex_init(&b.lock, NULL);
+  b.records = records;
+  b.outputTemplate = outputTemplate;
+  b.stylesheet = stylesheet;
+  b.options = options;
+  b.logMode = logMode;
+
+  /*
+   * Anything that is not thread safe is set up before the workers start
+   */
+  worker *workers = calloc(jobs, sizeof(worker));
+  if (!workers) {
+    fprintf(stderr, "Could not allocate workers.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < jobs; i++) {
+    workers[i].batch = &b;
+    workers[i].L = newLuaState();
+    collectConstants(stylesheet, workers[i].L);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  int started = 0;
+  for (; started < jobs; started++) {
+    if (pthread_create(&workers[started].thread, NULL, renderRecords, &workers[started])) {
+      fprintf(stderr, "Could not start worker thread.\n");
+      break;
+    }
+  }
+  if (!started) {
+    renderRecords(&workers[0]);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  fprintf(stdout, "Rendered %lu documents in %.3fs with %d threads (%.1f documents/sec).\n",
+          b.rendered, seconds, started ? started : 1, seconds > 0 ? b.rendered / seconds : 0.);
+  if (b.failed) {
+    fprintf(stderr, "%lu records failed.\n", b.failed);
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    lua_close(workers[i].L);
+  }
+  free(workers);
+  pthread_mutex_destroy(&b.lock);
+
+  return b.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,9 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+struct options;
+
+int renderBatch(FILE *records, const char *outputTemplate, cJSON *stylesheet,
+                struct options *options, int jobs, int logMode);
+
+#endif
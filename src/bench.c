@@ -0,0 +1,398 @@
+#include <cairo.h>
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "version.h"
+
+/*
+ * The shape of a synthetic document. Every page holds `nodes` text elements,
+ * each nested `depth` levels below the root. Style values are expressions with
+ * `expressions` operators, and `images` percent of the text elements also
+ * draw a PNG or an SVG icon.
+ */
+typedef struct scenario {
+  const char *name;
+  int nodes;
+  int depth;
+  int textLength;
+  int expressions;
+  int images;
+  int pages;
+} scenario;
+
+/*
+ * The documents rendered by "make bench". Each one varies a single parameter
+ * from the baseline.
+ */
+static const scenario scenarios[] = {
+    {"baseline", 200, 3, 60, 0, 0, 1},
+    {"deep", 200, 12, 60, 0, 0, 1},
+    {"long-text", 50, 3, 2000, 0, 0, 1},
+    {"expressions", 200, 3, 60, 12, 0, 1},
+    {"images", 200, 3, 60, 0, 25, 1},
+    {"pages", 200, 3, 60, 0, 0, 20},
+};
+
+static const char *lorem =
+    "Lorem ipsum dolor sit amet, consectetuer adipiscing elit. Ut purus elit, vestibulum "
+    "ut, placerat ac, adipiscing vitae, felis. Curabitur dictum gravida mauris. Nam arcu "
+    "libero, nonummy eget, consectetuer id, vulputate a, magna. Donec vehicula augue eu "
+    "neque. Pellentesque habitant morbi tristique senectus et netus et malesuada fames ac "
+    "turpis egestas. ";
+
+/*
+ * Print out a brief usage statement and exit
+ */
+static void usage(char *argv[]) {
+  fprintf(stderr,
+          "Usage: %s [-r repetitions] [-o report] [-x dsml2] [-w directory]\n"
+          "          [-n nodes] [-d depth] [-t text length] [-e expression operators]\n"
+          "          [-i image percentage] [-p pages]\n"
+          " Renders each benchmark document several times and writes the timings to a JSON\n"
+          " report. If any document parameter is given, only that document is rendered,\n"
+          " with the remaining parameters taken from the baseline.\n",
+          argv[0]);
+  exit(EXIT_FAILURE);
+}
+
+static void writeFile(const char *path, const char *data) {
+  FILE *f = fopen(path, "w");
+  if (!f || fputs(data, f) < 0 || fclose(f)) {
+    fprintf(stderr, "Could not write \"%s\".\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void writeJSON(const char *path, cJSON *tree) {
+  char *printed = cJSON_PrintUnformatted(tree);
+  if (!printed) {
+    fprintf(stderr, "Could not print \"%s\".\n", path);
+    exit(EXIT_FAILURE);
+  }
+  writeFile(path, printed);
+  cJSON_free(printed);
+}
+
+/*
+ * Write the images that documents draw, so that nothing is downloaded.
+ */
+static void writeImages(const char *directory, char *png, char *svg, size_t size) {
+  snprintf(png, size, "%s/image.png", directory);
+  snprintf(svg, size, "%s/icon.svg", directory);
+
+  cairo_surface_t *surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 32, 32);
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_source_rgb(cr, 0.2, 0.4, 0.8);
+  cairo_rectangle(cr, 4, 4, 24, 24);
+  cairo_fill(cr);
+  cairo_destroy(cr);
+  if (cairo_surface_write_to_png(surface, png) != CAIRO_STATUS_SUCCESS) {
+    fprintf(stderr, "Could not write \"%s\".\n", png);
+    exit(EXIT_FAILURE);
+  }
+  cairo_surface_destroy(surface);
+
+  writeFile(svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" viewBox=\"0 0 24 24\">"
+                 "<circle cx=\"12\" cy=\"12\" r=\"10\" fill=\"#c33\"/></svg>\n");
+}
+
+/*
+ * Build a style value: a plain number, or an expression with the given number
+ * of operators. Expressions that call a function are evaluated by Lua rather
+ * than natively.
+ */
+static void addValue(cJSON *style, const char *key, double value, int operators) {
+  if (!operators) {
+    cJSON_AddNumberToObject(style, key, value);
+    return;
+  }
+  char expression[4096];
+  int length = snprintf(expression, sizeof(expression), "math.max(0, %g", value);
+  for (int i = 1; i < operators && length < (int)sizeof(expression) - 32; i++) {
+    length += snprintf(expression + length, sizeof(expression) - length,
+                       i % 2 ? " + unit * %d" : " - unit * %d", i);
+  }
+  snprintf(expression + length, sizeof(expression) - length, ")");
+  cJSON_AddStringToObject(style, key, expression);
+}
+
+/*
+ * Generate the stylesheet for a scenario. Content keys are reused at every
+ * level, so the stylesheet only has one entry per kind of element.
+ */
+static cJSON *generateStylesheet(const scenario *s, const char *png, const char *svg) {
+  cJSON *stylesheet = cJSON_CreateObject();
+  cJSON *constants = cJSON_AddObjectToObject(stylesheet, "_constants");
+  cJSON_AddNumberToObject(constants, "unit", 0);
+
+  cJSON *page = cJSON_AddObjectToObject(stylesheet, "page");
+  cJSON *style = cJSON_AddObjectToObject(page, "_style");
+  addValue(style, "x", 54, s->expressions);
+  addValue(style, "y", 54, s->expressions);
+  addValue(style, "yOffset", s->depth > 1 ? 8 * 14 : 14, s->expressions);
+
+  cJSON *parent = page;
+  for (int level = 1; level < s->depth; level++) {
+    cJSON *group = cJSON_AddObjectToObject(parent, "group");
+    style = cJSON_AddObjectToObject(group, "_style");
+    addValue(style, "x", 2, s->expressions);
+    addValue(style, "yOffset", level == s->depth - 1 ? 14 : 0, s->expressions);
+    parent = group;
+  }
+
+  const char *kinds[] = {"item", "figure", "symbol"};
+  for (int i = 0; i < 3; i++) {
+    cJSON *item = cJSON_AddObjectToObject(parent, kinds[i]);
+    style = cJSON_AddObjectToObject(item, "_style");
+    addValue(style, "x", i ? 16 : 0, s->expressions);
+    addValue(style, "size", i == 1 ? 0.3 : 9, s->expressions);
+    addValue(style, "width", s->textLength > 200 ? 480 : 0, s->expressions);
+    if (i == 1) {
+      cJSON *image = cJSON_AddObjectToObject(item, "png");
+      cJSON_AddStringToObject(image, "filename", png);
+    } else if (i == 2) {
+      cJSON *icon = cJSON_AddObjectToObject(item, "icon");
+      cJSON_AddStringToObject(icon, "url", "http://localhost/icon.svg");
+      cJSON_AddStringToObject(icon, "name", svg);
+    }
+  }
+  return stylesheet;
+}
+
+/*
+ * Generate the content for a scenario, counting the nodes in it. Text is taken
+ * from a different place for every element, so that no two paragraphs are the
+ * same.
+ */
+static cJSON *generateContent(const scenario *s, long *count) {
+  cJSON *content = cJSON_CreateObject();
+  size_t loremLength = strlen(lorem);
+  char *text = malloc(s->textLength + 1);
+  if (!text) {
+    fprintf(stderr, "Could not allocate text.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *count = 1;
+  int item = 0;
+  for (int p = 0; p < s->pages; p++) {
+    if (p) {
+      cJSON_AddStringToObject(content, "pageBreak", "");
+      (*count)++;
+    }
+    cJSON *page = cJSON_AddObjectToObject(content, "page");
+    (*count)++;
+
+    /*
+     * Text elements are grouped in eights at the deepest level
+     */
+    for (int n = 0; n < s->nodes; n += 8) {
+      cJSON *parent = page;
+      for (int level = 1; level < s->depth; level++) {
+        parent = cJSON_AddObjectToObject(parent, "group");
+        (*count)++;
+      }
+      for (int i = n; i < n + 8 && i < s->nodes; i++, item++) {
+        for (int j = 0; j < s->textLength; j++) {
+          text[j] = lorem[(item * 7 + j) % loremLength];
+        }
+        text[s->textLength] = 0;
+        const char *kind = "item";
+        if (s->images && item % 100 < s->images) {
+          kind = item % 2 ? "symbol" : "figure";
+        }
+        cJSON_AddStringToObject(parent, kind, text);
+        (*count)++;
+      }
+    }
+  }
+  free(text);
+  return content;
+}
+
+/*
+ * Render a document once, returning the wall time in seconds and the peak
+ * resident set size of the renderer in kilobytes.
+ */
+static double render(const char *dsml2, const char *directory, long *rss) {
+  char contentPath[4096];
+  char stylesheetPath[4096];
+  char outputPath[4096];
+  snprintf(contentPath, sizeof(contentPath), "%s/content.json", directory);
+  snprintf(stylesheetPath, sizeof(stylesheetPath), "%s/stylesheet.json", directory);
+  snprintf(outputPath, sizeof(outputPath), "%s/output.pdf", directory);
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    execl(dsml2, dsml2, "-c", contentPath, "-s", stylesheetPath, "-o", outputPath, "-n",
+          (char *)NULL);
+    perror("execl");
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    exit(EXIT_FAILURE);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Rendering \"%s\" failed.\n", contentPath);
+    exit(EXIT_FAILURE);
+  }
+
+  *rss = usage.ru_maxrss;
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static int compareTimes(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Generate a scenario, render it after one untimed run to warm the caches,
+ * and add its results to the report.
+ */
+static void runScenario(const scenario *s, const char *dsml2, const char *workDirectory,
+                        int repetitions, cJSON *results) {
+  char directory[4096];
+  char png[4096];
+  char svg[4096];
+  char path[4096];
+  snprintf(directory, sizeof(directory), "%s/%s", workDirectory, s->name);
+  mkdir(workDirectory, 0755);
+  mkdir(directory, 0755);
+  writeImages(directory, png, svg, sizeof(png));
+
+  long nodes;
+  cJSON *content = generateContent(s, &nodes);
+  cJSON *stylesheet = generateStylesheet(s, png, svg);
+  snprintf(path, sizeof(path), "%s/content.json", directory);
+  writeJSON(path, content);
+  snprintf(path, sizeof(path), "%s/stylesheet.json", directory);
+  writeJSON(path, stylesheet);
+  cJSON_Delete(content);
+  cJSON_Delete(stylesheet);
+
+  double *times = calloc(repetitions, sizeof(double));
+  if (!times) {
+    fprintf(stderr, "Could not allocate timings.\n");
+    exit(EXIT_FAILURE);
+  }
+  long rss;
+  long peakRSS = 0;
+  render(dsml2, directory, &rss);
+  for (int i = 0; i < repetitions; i++) {
+    times[i] = render(dsml2, directory, &rss);
+    if (rss > peakRSS) {
+      peakRSS = rss;
+    }
+  }
+  qsort(times, repetitions, sizeof(double), compareTimes);
+  double median = repetitions % 2 ? times[repetitions / 2]
+                                  : (times[repetitions / 2 - 1] + times[repetitions / 2]) / 2;
+  int rank = (95 * repetitions + 99) / 100;
+  double p95 = times[rank - 1];
+  free(times);
+
+  cJSON *result = cJSON_CreateObject();
+  cJSON_AddStringToObject(result, "name", s->name);
+  cJSON *parameters = cJSON_AddObjectToObject(result, "parameters");
+  cJSON_AddNumberToObject(parameters, "nodes", s->nodes);
+  cJSON_AddNumberToObject(parameters, "depth", s->depth);
+  cJSON_AddNumberToObject(parameters, "textLength", s->textLength);
+  cJSON_AddNumberToObject(parameters, "expressions", s->expressions);
+  cJSON_AddNumberToObject(parameters, "images", s->images);
+  cJSON_AddNumberToObject(parameters, "pages", s->pages);
+  cJSON_AddNumberToObject(result, "totalNodes", nodes);
+  cJSON_AddNumberToObject(result, "median", median);
+  cJSON_AddNumberToObject(result, "p95", p95);
+  cJSON_AddNumberToObject(result, "pagesPerSecond", median > 0 ? s->pages / median : 0);
+  cJSON_AddNumberToObject(result, "nodesPerSecond", median > 0 ? nodes / median : 0);
+  cJSON_AddNumberToObject(result, "peakRSSKilobytes", peakRSS);
+  cJSON_AddItemToArray(results, result);
+
+  fprintf(stdout, "%-12s %8ld nodes %4d pages  median %8.2f ms  p95 %8.2f ms  %10.0f nodes/s  %8ld kB\n",
+          s->name, nodes, s->pages, median * 1e3, p95 * 1e3, median > 0 ? nodes / median : 0.,
+          peakRSS);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  const char *dsml2 = "./build/dsml2";
+  const char *reportPath = "build/bench.json";
+  const char *workDirectory = "build/bench";
+  int repetitions = 10;
+  scenario custom = scenarios[0];
+  custom.name = "custom";
+  int customGiven = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:o:x:w:n:d:t:e:i:p:h")) != -1) {
+    if (opt == 'r') {
+      repetitions = atoi(optarg);
+    } else if (opt == 'o') {
+      reportPath = optarg;
+    } else if (opt == 'x') {
+      dsml2 = optarg;
+    } else if (opt == 'w') {
+      workDirectory = optarg;
+    } else if (opt == 'n') {
+      custom.nodes = atoi(optarg);
+    } else if (opt == 'd') {
+      custom.depth = atoi(optarg);
+    } else if (opt == 't') {
+      custom.textLength = atoi(optarg);
+    } else if (opt == 'e') {
+      custom.expressions = atoi(optarg);
+    } else if (opt == 'i') {
+      custom.images = atoi(optarg);
+    } else if (opt == 'p') {
+      custom.pages = atoi(optarg);
+    } else {
+      usage(argv);
+    }
+    customGiven |= strchr("ndteip", opt) != NULL;
+  }
+  if (optind != argc || repetitions < 1 || custom.nodes < 0 || custom.depth < 1 ||
+      custom.textLength < 0 || custom.expressions < 0 || custom.images < 0 ||
+      custom.images > 100 || custom.pages < 1) {
+    usage(argv);
+  }
+
+  cJSON *report = cJSON_CreateObject();
+  cJSON_AddStringToObject(report, "version", DSML_VERSION);
+  cJSON_AddNumberToObject(report, "repetitions", repetitions);
+  cJSON *results = cJSON_AddArrayToObject(report, "scenarios");
+
+  if (customGiven) {
+    runScenario(&custom, dsml2, workDirectory, repetitions, results);
+  } else {
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+      runScenario(&scenarios[i], dsml2, workDirectory, repetitions, results);
+    }
+  }
+
+  char *printed = cJSON_Print(report);
+  writeFile(reportPath, printed);
+  cJSON_free(printed);
+  cJSON_Delete(report);
+  fprintf(stdout, "Report written to \"%s\".\n", reportPath);
+}
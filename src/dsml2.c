@@ -1,19 +1,33 @@
 #include <cairo-pdf.h>
 #include <cjson/cJSON.h>
+#include <curl/curl.h>
 #include <getopt.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <pango/pangocairo.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <zlib.h>
 
+#include "batch.h"
 #include "dsml2.h"
+#include "expr.h"
+#include "fetch.h"
+#include "image.h"
+#include "index.h"
 #include "io.h"
 #include "lua.h"
+#include "memo.h"
+#include "profile.h"
+#include "raster.h"
 #include "render.h"
+#include "shape.h"
+#include "stream.h"
 #include "style.h"
 #include "traverse.h"
 #include "version.h"
+#include "watch.h"
 
 /*
  * Print out a brief usage statement and exit
@@ -23,7 +37,34 @@ void usage(char *argv[]) {
           "Usage: %s [-c content] [-s stylesheet] [-o output file]\n"
           " -c,--content      The file that contains the document content. Default \"content.json\".\n"
           " -s,--stylesheet   The file that contains the document style. Default \"stylesheet.json\".\n"
-          " -o,--output       The output file. Defaults to stdout.\n"
+          " -o,--output       The output file. Defaults to stdout. In batch mode, a template in which\n"
+          "                   \"%%n\" is replaced by the record number. Default \"%%n.pdf\".\n"
+          " -b,--batch        Render each line of a newline-delimited JSON file (\"-\" for stdin) as\n"
+          "                   the content of a separate document.\n"
+          " -j,--jobs         The number of documents to render at once in batch mode. Defaults to the\n"
+          "                   number of processors. Otherwise, the number of threads that pages\n"
+          "                   separated by top level \"pageBreak\" elements are rendered on.\n"
+          " -S,--stream       Read the content file one top level element at a time, and write\n"
+          "                   pages out as they are finished.\n"
+          " -w,--watch        Render again whenever the content, the stylesheet, or a file they use\n"
+          "                   changes. Requires an output file.\n"
+          " -l,--layout-cache A directory in which shaped text is kept between runs.\n"
+          " -r,--resource-cache\n"
+          "                   A directory in which downloaded icons are kept between runs.\n"
+          " -n,--offline      Never download icons, only use local files and the resource cache.\n"
+          " -R,--revalidate   Download icons again if they have changed since they were fetched.\n"
+          " -p,--profile      Time each phase and node, and write a JSON report to a file (\"-\" for\n"
+          "                   stdout) when finished.\n"
+          " -t,--trace        Write a trace of phases, nodes, expressions and downloads to a file,\n"
+          "                   for chrome://tracing or Perfetto.\n"
+          " -P,--png          Write each page as a PNG image at this resolution in dots per inch,\n"
+          "                   instead of a PDF. \"%%p\" in the output file is replaced by the page\n"
+          "                   number. Requires an output file.\n"
+          " -T,--tiles        The number of tiles, each rasterized on its own thread, that PNG\n"
+          "                   pages are split into. Defaults to the number of processors.\n"
+          " -d,--draft        Draw images as placeholders, leave out links, and lay text out\n"
+          "                   without hinting, for quick previews.\n"
+          " -B,--boxes        Draft mode, also outlining the extents of each text.\n"
           " -v,--verbose      Verbose mode.\n"
           " -V,--version      Print out version string.\n"
           "",
@@ -33,43 +74,60 @@ void usage(char *argv[]) {
 
 int main(int argc, char *argv[]) {
 
-  /*
-   * The cairo context object
-   */
-  cairo_t *cr;
-
   char outfileName[256] = "/dev/stdout";
+  int outfileGiven = 0;
   FILE *contentFile = NULL;
   FILE *stylesheetFile = NULL;
+  FILE *batchFile = NULL;
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int jobsGiven = 0;
   int logMode = LOG_NONE;
+  int streamMode = 0;
+  int watchMode = 0;
+  double dpi = 0;
+  int tiles = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *contentPath = "content.json";
+  const char *stylesheetPath = "stylesheet.json";
+  fetchOptions fetch = {0};
+  fetch.cacheLimit = RESOURCE_CACHE_LIMIT;
+  fetch.connections = FETCH_CONNECTIONS;
+  fetch.timeout = FETCH_TIMEOUT;
 
   /*
    * Initialize the Lua library
    */
-
-  lua_State *L = luaL_newstate();
-  luaL_openlibs(L);
+  lua_State *L = newLuaState();
+  curl_global_init(CURL_GLOBAL_DEFAULT);
 
   /*
-   * Evaluate a string that defines a function
+   * Cache files are written under temporary names, which need the umask
    */
-  char *buf = "function eval(n);return load('return '..n)();end";
-  int error = luaL_loadbuffer(L, buf, strlen(buf), "") || lua_pcall(L, 0, 0, 0);
-  if (error) {
-    fprintf(stderr, "%s\n", lua_tostring(L, -1));
-    exit(EXIT_FAILURE);
-  }
+  readUmask();
 
   /*
    * Handle program arguments
    */
   int opt;
   int option_index = 0;
-  char *optstring = "c:s:o:hvV";
+  char *optstring = "c:s:o:b:j:Swl:r:nRp:t:P:T:dBhvV";
   static struct option long_options[] = {
       {"content", required_argument, 0, 'c'},
       {"stylesheet", required_argument, 0, 's'},
       {"output", required_argument, 0, 'o'},
+      {"batch", required_argument, 0, 'b'},
+      {"jobs", required_argument, 0, 'j'},
+      {"stream", no_argument, 0, 'S'},
+      {"watch", no_argument, 0, 'w'},
+      {"layout-cache", required_argument, 0, 'l'},
+      {"resource-cache", required_argument, 0, 'r'},
+      {"offline", no_argument, 0, 'n'},
+      {"revalidate", no_argument, 0, 'R'},
+      {"profile", required_argument, 0, 'p'},
+      {"trace", required_argument, 0, 't'},
+      {"png", required_argument, 0, 'P'},
+      {"tiles", required_argument, 0, 'T'},
+      {"draft", no_argument, 0, 'd'},
+      {"boxes", no_argument, 0, 'B'},
       {"help", no_argument, 0, 'h'},
       {"verbose", no_argument, 0, 'v'},
       {"version", no_argument, 0, 'V'},
@@ -81,8 +139,10 @@ int main(int argc, char *argv[]) {
     }
     if (opt == 'o') {
       strncpy(outfileName, optarg, 255);
+      outfileGiven = 1;
     }
     if (opt == 'c') {
+      contentPath = optarg;
       contentFile = fopen(optarg, "rb");
       if (!contentFile) {
         perror("fopen");
@@ -90,12 +150,72 @@ int main(int argc, char *argv[]) {
       }
     }
     if (opt == 's') {
+      stylesheetPath = optarg;
       stylesheetFile = fopen(optarg, "rb");
       if (!stylesheetFile) {
         perror("fopen");
         usage(argv);
       }
     }
+    if (opt == 'b') {
+      batchFile = strcmp(optarg, "-") == 0 ? stdin : fopen(optarg, "rb");
+      if (!batchFile) {
+        perror("fopen");
+        usage(argv);
+      }
+    }
+    if (opt == 'j') {
+      jobs = atoi(optarg);
+      jobsGiven = 1;
+      if (jobs < 1) {
+        fprintf(stderr, "The number of jobs must be at least 1.\n");
+        usage(argv);
+      }
+    }
+    if (opt == 'S') {
+      streamMode = 1;
+    }
+    if (opt == 'w') {
+      watchMode = 1;
+    }
+    if (opt == 'l') {
+      setShapeCacheDirectory(optarg);
+    }
+    if (opt == 'r') {
+      fetch.cacheDirectory = optarg;
+    }
+    if (opt == 'n') {
+      fetch.offline = 1;
+    }
+    if (opt == 'R') {
+      fetch.revalidate = 1;
+    }
+    if (opt == 'p') {
+      enableProfile(optarg);
+    }
+    if (opt == 't') {
+      enableTrace(optarg);
+    }
+    if (opt == 'P') {
+      dpi = atof(optarg);
+      if (dpi <= 0) {
+        fprintf(stderr, "The resolution must be greater than 0.\n");
+        usage(argv);
+      }
+    }
+    if (opt == 'T') {
+      tiles = atoi(optarg);
+      if (tiles < 1) {
+        fprintf(stderr, "The number of tiles must be at least 1.\n");
+        usage(argv);
+      }
+    }
+    if (opt == 'd' && !draft) {
+      draft = DRAFT_ON;
+    }
+    if (opt == 'B') {
+      draft = DRAFT_BOXES;
+    }
     if (opt == 'v') {
       logMode = LOG_VERBOSE;
     }
@@ -120,7 +240,7 @@ int main(int argc, char *argv[]) {
   /*
    * Failover to default locations if they exist
    */
-  if (!contentFile) {
+  if (!contentFile && !batchFile) {
     contentFile = fopen("content.json", "rb");
     if (!contentFile) {
       fprintf(stderr, "Please specify a content file.\n");
@@ -128,6 +248,23 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  if (streamMode && batchFile) {
+    fprintf(stderr, "Streaming mode cannot be combined with batch mode.\n");
+    usage(argv);
+  }
+  if (watchMode && (streamMode || batchFile || !outfileGiven)) {
+    fprintf(stderr, "Watch mode needs an output file, and cannot be combined with streaming or batch mode.\n");
+    usage(argv);
+  }
+  if (dpi && (streamMode || batchFile || watchMode || !outfileGiven)) {
+    fprintf(stderr, "PNG output needs an output file, and cannot be combined with streaming, batch or watch mode.\n");
+    usage(argv);
+  }
+  if (watchMode && profiling) {
+    fprintf(stderr, "Profiling and tracing cannot be combined with watch mode, which never finishes.\n");
+    usage(argv);
+  }
+
   if (!stylesheetFile) {
     stylesheetFile = fopen("stylesheet.json", "rb");
     if (!stylesheetFile) {
@@ -137,27 +274,88 @@ int main(int argc, char *argv[]) {
   }
 
   /*
-   * Generate checksums
+   * Watch mode reads the files itself, every time they change
    */
-  unsigned int contentChecksum = checksumFile(contentFile);
-  unsigned int stylesheetChecksum = checksumFile(stylesheetFile);
+  if (watchMode) {
+    fclose(contentFile);
+    fclose(stylesheetFile);
+    lua_close(L);
+    int status = watchDocument(contentPath, stylesheetPath, outfileName, &fetch, logMode);
+    curl_global_cleanup();
+    return status;
+  }
+
+  /*
+   * Read each input file once, and use the same copy for the checksum and the
+   * parse. In streaming mode, the content is never held in memory at once.
+   */
+  beginPhase(PHASE_PARSE);
+  inputFile stylesheetInput;
+  inputFile contentInput = {0};
+  mapFile(stylesheetFile, &stylesheetInput);
+  if (contentFile && !streamMode) {
+    mapFile(contentFile, &contentInput);
+  }
+
+  /*
+   * Generate checksums. In batch mode, the content checksum is generated for
+   * each record instead.
+   */
+  unsigned int stylesheetChecksum = checksumData(&stylesheetInput);
   if (logMode == LOG_VERBOSE) {
     fprintf(stdout, "DSML version: %s\n", DSML_VERSION);
-    fprintf(stdout, "Content file checksum: %x\n", contentChecksum);
     fprintf(stdout, "Style file checksum: %x\n", stylesheetChecksum);
   }
-  setContentChecksum(contentChecksum);
   setStylesheetChecksum(stylesheetChecksum);
+  if (contentFile) {
+    unsigned int contentChecksum = streamMode ? checksumStream(contentFile)
+                                              : checksumData(&contentInput);
+    if (logMode == LOG_VERBOSE) {
+      fprintf(stdout, "Content file checksum: %x\n", contentChecksum);
+    }
+    setContentChecksum(contentChecksum);
+  }
 
   /*
    * Ingest files
    */
-  cJSON *content = readJSONFile(contentFile);
-  cJSON *stylesheet = readJSONFile(stylesheetFile);
+  cJSON *content = contentFile && !streamMode ? parseJSON(&contentInput) : NULL;
+  cJSON *stylesheet = parseJSON(&stylesheetInput);
+  unmapFile(&contentInput);
+  unmapFile(&stylesheetInput);
+  endPhase(PHASE_PARSE);
+
+  /*
+   * Turn numeric strings into numbers so that they are never evaluated
+   */
+  beginPhase(PHASE_INDEX);
+  foldNumbers(stylesheet);
+
+  /*
+   * Build hash tables for key lookups in both trees
+   */
+  if (content) {
+    indexTree(content);
+  }
+  indexTree(stylesheet);
+  digestTrees(content, stylesheet);
+  endPhase(PHASE_INDEX);
+
+  /*
+   * Fetch any icons that are missing, so that rendering only ever sees local
+   * files. Drafts only draw placeholders, and never need them.
+   */
+  beginPhase(PHASE_FETCH);
+  int failures = draft ? 0 : prefetchIcons(content, stylesheet, &fetch);
+  endPhase(PHASE_FETCH);
+  if (failures) {
+    fprintf(stderr, "%d icons could not be fetched.\n", failures);
+  }
 
   /*
    * Evaluate all constants for use throughout the stylesheet tree
    */
+  beginPhase(PHASE_CONSTANTS);
   collectConstants(stylesheet, L);
 
   /*
@@ -167,42 +365,89 @@ int main(int argc, char *argv[]) {
   options.pageWidth = 8.5 * POINTS_PER_INCH;
   options.pageHeight = 11 * POINTS_PER_INCH;
   applyOptions(stylesheet, L, &options);
+  endPhase(PHASE_CONSTANTS);
 
   /*
-   * Initialize the Cairo surface
+   * Evaluate the "_style" elements ahead of rendering. When the whole content
+   * is already here, only the ones it uses; batch records and streamed
+   * content are not known yet, so they need all of them.
    */
+  beginPhase(PHASE_STYLES);
+  if (content && !batchFile) {
+    compileUsedStyles(content, stylesheet, L);
+  } else {
+    compileStyles(stylesheet, L);
+  }
+  endPhase(PHASE_STYLES);
+
   if (logMode == LOG_VERBOSE) {
     fprintf(stdout, "%f\n", options.pageWidth);
     fprintf(stdout, "%f\n", options.pageHeight);
   }
-  cairo_surface_t *surface = cairo_pdf_surface_create(
-      outfileName, options.pageWidth, options.pageHeight);
 
-  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+  int status = EXIT_SUCCESS;
+  if (batchFile) {
+
+    /*
+     * Render every record in the batch file against the same stylesheet
+     */
+    status = renderBatch(batchFile, outfileGiven ? outfileName : "%n.pdf",
+                         stylesheet, &options, jobs, logMode);
+  } else if (streamMode) {
+
+    /*
+     * Render while reading the content
+     */
+    contentStream *stream = openContentStream(contentFile);
+    if (renderStream(outfileName, stream, stylesheet, L, &options, logMode)) {
+      fprintf(stderr, "Invalid filename.\n");
+      usage(argv);
+    }
+    closeContentStream(stream);
+  } else if (dpi) {
+
+    /*
+     * Rasterize each page straight to an image
+     */
+    if (renderRaster(outfileName, content, stylesheet, L, &options, dpi, tiles,
+                     jobsGiven ? jobs : 1, logMode)) {
+      fprintf(stderr, "Could not write \"%s\".\n", outfileName);
+      status = EXIT_FAILURE;
+    }
+  } else if (renderDocument(outfileName, content, stylesheet, L, &options, jobsGiven ? jobs : 1, logMode)) {
     fprintf(stderr, "Invalid filename.\n");
     usage(argv);
   }
-  cr = cairo_create(surface);
-
-  simultaneous_traversal(cr, content, stylesheet, L, logMode);
-
-  /*
-   * Technically, we don't need to use this function because we are only
-   * rendering a single page. If we were rendering multiple pages then we would
-   * use multiple calls to cairo_show_page().
-   */
-  cairo_show_page(cr);
 
   /*
    * Cleanup
    */
-  cairo_surface_destroy(surface);
-  cairo_destroy(cr);
-
-  fclose(contentFile);
+  if (contentFile) {
+    fclose(contentFile);
+  }
+  if (batchFile && batchFile != stdin) {
+    fclose(batchFile);
+  }
   fclose(stylesheetFile);
   cJSON_Delete(content);
   cJSON_Delete(stylesheet);
+  freeStyleRecords();
+  freeIndex();
 
+  if (logMode == LOG_VERBOSE) {
+    printExpressionStats();
+    printConstantStats(L);
+    printTextStats();
+    printImageStats();
+  }
+  freeRenderCaches();
+  freeImages();
+  trimShapeCache();
+  writeProfile();
+
+  clearConstants();
   lua_close(L);
+  curl_global_cleanup();
+
+  return status;
 }
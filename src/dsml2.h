@@ -7,4 +7,23 @@
  */
 #define POINTS_PER_INCH 72
 
+/*
+ * Missing icons are downloaded before rendering over at most this many
+ * connections at once, and each transfer is given up on after this many
+ * seconds.
+ */
+#define FETCH_CONNECTIONS 8
+#define FETCH_TIMEOUT 30
+
+/*
+ * The resource cache directory is trimmed to this size after every run, by
+ * deleting the least recently used files first.
+ */
+#define RESOURCE_CACHE_LIMIT (512UL * 1024 * 1024)
+
+/*
+ * The number of nodes listed in a profile report, slowest first.
+ */
+#define PROFILE_SLOWEST_NODES 25
+
 #endif
@@ -0,0 +1,334 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+/*
+ * Nesting limit for parenthesised sub-expressions. Anything deeper is handed
+ * back to Lua.
+ */
+#define MAX_DEPTH 64
+
+/*
+ * Native copy of every numeric constant in the "_constants" section, stored in
+ * an open-addressed hash table so that arithmetic expressions can be evaluated
+ * without calling into Lua.
+ */
+typedef struct constant {
+  char *name;
+  double value;
+} constant;
+
+static constant *constants;
+static size_t constantsSize;
+static size_t constantsCount;
+
+/*
+ * Constants are evaluated when they are first used, so a name that is not in
+ * the table may still be one that has not been evaluated yet.
+ */
+static constantResolver resolver;
+
+static unsigned long hashName(const char *s, size_t length) {
+  unsigned long hash = 14695981039346656037UL;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static constant *findSlot(constant *table, size_t size, const char *name, size_t length) {
+  size_t i = hashName(name, length) & (size - 1);
+  while (table[i].name) {
+    if (strncmp(table[i].name, name, length) == 0 && table[i].name[length] == 0) {
+      break;
+    }
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+/*
+ * Record the value of a named constant, replacing any previous value.
+ */
+void setConstant(const char *name, double value) {
+  if ((constantsCount + 1) * 2 > constantsSize) {
+    size_t size = constantsSize ? constantsSize * 2 : 64;
+    constant *table = calloc(size, sizeof(constant));
+    if (!table) {
+      fprintf(stderr, "Could not allocate constant table.\n");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < constantsSize; i++) {
+      if (constants[i].name) {
+        *findSlot(table, size, constants[i].name, strlen(constants[i].name)) = constants[i];
+      }
+    }
+    free(constants);
+    constants = table;
+    constantsSize = size;
+  }
+
+  constant *slot = findSlot(constants, constantsSize, name, strlen(name));
+  if (!slot->name) {
+    slot->name = strdup(name);
+    constantsCount++;
+  }
+  slot->value = value;
+}
+
+/*
+ * Look up a constant by name. The name does not need to be null terminated.
+ * Returns zero if no such constant exists.
+ */
+int getConstant(const char *name, size_t length, double *value) {
+  if (!constants) {
+    return 0;
+  }
+  constant *slot = findSlot(constants, constantsSize, name, length);
+  if (!slot->name) {
+    return 0;
+  }
+  *value = slot->value;
+  return 1;
+}
+
+void setConstantResolver(constantResolver resolve) {
+  resolver = resolve;
+}
+
+void clearConstants() {
+  for (size_t i = 0; i < constantsSize; i++) {
+    free(constants[i].name);
+  }
+  free(constants);
+  constants = NULL;
+  constantsSize = 0;
+  constantsCount = 0;
+}
+
+/*
+ * A small recursive descent parser for the subset of Lua expressions that
+ * appear in nearly every stylesheet: numbers, constants, parentheses, and the
+ * four basic arithmetic operators. Every function returns zero as soon as it
+ * sees something outside of that subset so that the caller can fall back to
+ * Lua, which also takes care of reporting genuine syntax errors.
+ */
+static int parseSum(const char **s, double *result, int depth);
+
+static void skipSpace(const char **s) {
+  while (isspace((unsigned char)**s)) {
+    (*s)++;
+  }
+}
+
+static int parsePrimary(const char **s, double *result, int depth) {
+  skipSpace(s);
+  const char *p = *s;
+
+  if (*p == '(') {
+    if (depth >= MAX_DEPTH) {
+      return 0;
+    }
+    *s = p + 1;
+    if (!parseSum(s, result, depth + 1)) {
+      return 0;
+    }
+    skipSpace(s);
+    if (**s != ')') {
+      return 0;
+    }
+    (*s)++;
+    return 1;
+  }
+
+  if (isdigit((unsigned char)*p) || *p == '.') {
+    char *end;
+    *result = strtod(p, &end);
+    if (end == p || isalnum((unsigned char)*end) || *end == '_' || *end == '.') {
+      return 0;
+    }
+    *s = end;
+    return 1;
+  }
+
+  if (isalpha((unsigned char)*p) || *p == '_') {
+    const char *end = p;
+    while (isalnum((unsigned char)*end) || *end == '_') {
+      end++;
+    }
+    if (!getConstant(p, end - p, result) && !(resolver && resolver(p, end - p, result))) {
+      return 0;
+    }
+    *s = end;
+    return 1;
+  }
+
+  return 0;
+}
+
+static int parseUnary(const char **s, double *result, int depth) {
+  skipSpace(s);
+
+  /*
+   * A doubled minus sign starts a comment in Lua, so leave it to Lua.
+   */
+  if (**s == '-') {
+    if ((*s)[1] == '-' || depth >= MAX_DEPTH) {
+      return 0;
+    }
+    (*s)++;
+    if (!parseUnary(s, result, depth + 1)) {
+      return 0;
+    }
+    *result = -*result;
+    return 1;
+  }
+  return parsePrimary(s, result, depth);
+}
+
+static int parseProduct(const char **s, double *result, int depth) {
+  if (!parseUnary(s, result, depth)) {
+    return 0;
+  }
+  while (1) {
+    skipSpace(s);
+    char op = **s;
+    if (op != '*' && op != '/') {
+      return 1;
+    }
+
+    /*
+     * "//" is floor division in Lua.
+     */
+    if ((*s)[1] == '/') {
+      return 0;
+    }
+    (*s)++;
+    double rhs;
+    if (!parseUnary(s, &rhs, depth)) {
+      return 0;
+    }
+    if (op == '*') {
+      *result *= rhs;
+    } else {
+      *result /= rhs;
+    }
+  }
+}
+
+static int parseSum(const char **s, double *result, int depth) {
+  if (!parseProduct(s, result, depth)) {
+    return 0;
+  }
+  while (1) {
+    skipSpace(s);
+    char op = **s;
+    if (op != '+' && op != '-') {
+      return 1;
+    }
+    if (op == '-' && (*s)[1] == '-') {
+      return 0;
+    }
+    (*s)++;
+    double rhs;
+    if (!parseProduct(s, &rhs, depth)) {
+      return 0;
+    }
+    if (op == '+') {
+      *result += rhs;
+    } else {
+      *result -= rhs;
+    }
+  }
+}
+
+/*
+ * Evaluate a plain arithmetic expression over numbers and known constants.
+ * Returns zero if the expression uses anything else, in which case it must be
+ * evaluated by Lua instead.
+ */
+int evalArithmetic(const char *s, double *result) {
+  double value;
+  if (!parseSum(&s, &value, 0)) {
+    return 0;
+  }
+  skipSpace(&s);
+  if (*s) {
+    return 0;
+  }
+  *result = value;
+  return 1;
+}
+
+/*
+ * Replace the string value of a node with a number if the string is nothing
+ * more than a numeric literal, so that it never needs to be evaluated.
+ */
+static void foldNode(cJSON *node) {
+  const char *s = node->valuestring;
+  while (isspace((unsigned char)*s)) {
+    s++;
+  }
+  int negative = *s == '-';
+  s += negative;
+  if (!isdigit((unsigned char)*s) && *s != '.') {
+    return;
+  }
+
+  char *end;
+  double value = strtod(s, &end);
+  if (end == s) {
+    return;
+  }
+  while (isspace((unsigned char)*end)) {
+    end++;
+  }
+  if (*end) {
+    return;
+  }
+
+  cJSON_free(node->valuestring);
+  node->valuestring = NULL;
+  node->type = cJSON_Number | (node->type & cJSON_StringIsConst);
+  cJSON_SetNumberHelper(node, negative ? -value : value);
+}
+
+static void foldSection(cJSON *section) {
+  cJSON *node = section->child;
+  while (node) {
+    if (cJSON_IsObject(node)) {
+      foldSection(node);
+    } else if (cJSON_IsString(node) &&
+               strcmp(node->string, "face") != 0 &&
+               strcmp(node->string, "URI") != 0 &&
+               strcmp(node->string, "textAlign") != 0) {
+      foldNode(node);
+    }
+    node = node->next;
+  }
+}
+
+/*
+ * Walk the stylesheet and fold every numeric string (such as ".3" or "1.5")
+ * in the "_style", "_options", and "_constants" sections into a number at load
+ * time.
+ */
+void foldNumbers(cJSON *stylesheet) {
+  cJSON *node = stylesheet->child;
+  while (node) {
+    if (cJSON_IsObject(node)) {
+      if (strcmp(node->string, "_style") == 0 ||
+          strcmp(node->string, "_options") == 0 ||
+          strcmp(node->string, "_constants") == 0) {
+        foldSection(node);
+      } else {
+        foldNumbers(node);
+      }
+    }
+    node = node->next;
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <cjson/cJSON.h>
+
+/*
+ * Called with the name of a constant that is not in the table yet. Returns
+ * zero if there is no numeric constant by that name.
+ */
+typedef int (*constantResolver)(const char *name, size_t length, double *value);
+
+void setConstant(const char *name, double value);
+int getConstant(const char *name, size_t length, double *value);
+void setConstantResolver(constantResolver resolve);
+void clearConstants();
+int evalArithmetic(const char *s, double *result);
+void foldNumbers(cJSON *stylesheet);
+
+#endif
@@ -0,0 +1,529 @@
+#include <cairo.h>
+#include <cjson/cJSON.h>
+#include <curl/curl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <glib.h>
+#include <lauxlib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "fetch.h"
+#include "io.h"
+#include "profile.h"
+#include "traverse.h"
+
+/*
+ * The length of a SHA-256 digest in hexadecimal
+ */
+#define DIGEST_LENGTH 64
+
+/*
+ * How old, in seconds, a temporary download in the cache directory must be
+ * before it is taken to be left behind by a run that died. Downloads waiting
+ * for a connection are not written to for a while, so this is generous.
+ */
+#define STALE_DOWNLOAD_AGE (24 * 60 * 60)
+
+/*
+ * An icon that may have to be downloaded before rendering. The file is written
+ * under a temporary name and only renamed into place once the transfer has
+ * succeeded, so that a failed download never leaves a broken icon behind. The
+ * digest and length of the data are tracked as it arrives.
+ */
+typedef struct download {
+  const char *url;
+  const char *name;
+  char temporary[4096];
+  FILE *file;
+  CURL *handle;
+  GChecksum *checksum;
+  char digest[DIGEST_LENGTH + 1];
+  unsigned long length;
+  int cached;
+  int local;
+  char cachedDigest[DIGEST_LENGTH + 1];
+  unsigned long cachedLength;
+  char blob[4096];
+  time_t validated;
+  double started;
+} download;
+
+typedef struct downloadList {
+  download *downloads;
+  int count;
+  int size;
+} downloadList;
+
+static size_t writeCallback(void *ptr, size_t size, size_t nmemb, download *d) {
+  size_t written = fwrite(ptr, size, nmemb, d->file);
+  g_checksum_update(d->checksum, ptr, written * size);
+  d->length += written * size;
+  return written;
+}
+
+/*
+ * Add an icon to the list, unless it is already listed.
+ */
+static void addDownload(downloadList *list, const char *url, const char *name) {
+  for (int i = 0; i < list->count; i++) {
+    if (strcmp(list->downloads[i].name, name) == 0) {
+      return;
+    }
+  }
+  if (list->count == list->size) {
+    list->size = list->size ? list->size * 2 : 8;
+    list->downloads = realloc(list->downloads, list->size * sizeof(download));
+    if (!list->downloads) {
+      fprintf(stderr, "Could not allocate download list.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  download *d = &list->downloads[list->count++];
+  memset(d, 0, sizeof(download));
+  d->url = url;
+  d->name = name;
+}
+
+/*
+ * Walk a tree and collect the "url" and "name" of every "icon" element.
+ */
+static void collectIcons(cJSON *tree, downloadList *list) {
+  for (cJSON *node = tree ? tree->child : NULL; node; node = node->next) {
+    if (!cJSON_IsObject(node)) {
+      continue;
+    }
+    if (node->string && strcmp(node->string, "icon") == 0) {
+      cJSON *u = find(node, "url");
+      cJSON *n = find(node, "name");
+      if (cJSON_IsString(u) && cJSON_IsString(n)) {
+        addDownload(list, u->valuestring, n->valuestring);
+      }
+    }
+    collectIcons(node, list);
+  }
+}
+
+/*
+ * The resource cache is a directory of blobs named by the SHA-256 digest and
+ * length of their data, and of small entries, named by a hash of a URL, that
+ * record which blob the URL last returned. Blobs are verified against their
+ * names whenever they are used, and their modification times record when they
+ * were last used.
+ */
+static void urlPath(char *path, size_t size, const char *directory, const char *url) {
+  unsigned long hash = 14695981039346656037UL;
+  for (const char *p = url; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 1099511628211UL;
+  }
+  snprintf(path, size, "%s/%016lx.url", directory, hash);
+}
+
+static void blobPath(char *path, size_t size, const char *directory, const char *digest,
+                     unsigned long length) {
+  snprintf(path, size, "%s/%s-%lu.blob", directory, digest, length);
+}
+
+/*
+ * Read an entry: the URL on the first line, then the digest and length of its
+ * blob. Returns the URL, which the caller frees, or NULL if the entry is
+ * malformed.
+ */
+static char *readEntry(FILE *f, char *digest, unsigned long *length) {
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t read = getline(&line, &capacity, f);
+  if (read <= 0 || line[read - 1] != '\n' ||
+      fscanf(f, "%64[0-9a-f]-%lu", digest, length) != 2 || strlen(digest) != DIGEST_LENGTH) {
+    free(line);
+    return NULL;
+  }
+  line[read - 1] = 0;
+  return line;
+}
+
+/*
+ * Find the blob that a URL was last fetched into. The time at which it was
+ * last validated against the server is the modification time of the entry.
+ * Returns -1 on a miss.
+ */
+static int lookupURL(const char *directory, download *d) {
+  char path[4096];
+  urlPath(path, sizeof(path), directory, d->url);
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return -1;
+  }
+
+  char *url = readEntry(f, d->cachedDigest, &d->cachedLength);
+  int ok = url && strcmp(url, d->url) == 0;
+  free(url);
+
+  struct stat st;
+  ok = ok && fstat(fileno(f), &st) == 0;
+  fclose(f);
+  if (!ok) {
+    return -1;
+  }
+  d->validated = st.st_mtime;
+  blobPath(d->blob, sizeof(d->blob), directory, d->cachedDigest, d->cachedLength);
+  return access(d->blob, R_OK) == 0 ? 0 : -1;
+}
+
+/*
+ * Write a file by way of a temporary file and a rename, so that readers in
+ * other processes never see it half written.
+ */
+static int writeAtomically(const char *path, const void *data, size_t length) {
+  char temporary[4096];
+  snprintf(temporary, sizeof(temporary), "%s.XXXXXX", path);
+  int fd = makeTemporary(temporary);
+  if (fd < 0) {
+    return -1;
+  }
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(temporary);
+    return -1;
+  }
+  int ok = fwrite(data, 1, length, f) == length;
+  if (fclose(f) != 0 || !ok || rename(temporary, path) != 0) {
+    unlink(temporary);
+    return -1;
+  }
+  return 0;
+}
+
+static int storeURL(const char *directory, const download *d) {
+  char path[4096];
+  char entry[4096 + 64];
+  urlPath(path, sizeof(path), directory, d->url);
+  int length = snprintf(entry, sizeof(entry), "%s\n%s-%lu\n", d->url, d->digest, d->length);
+  if (length >= (int)sizeof(entry)) {
+    return -1;
+  }
+  return writeAtomically(path, entry, length);
+}
+
+/*
+ * Copy a blob to the path where the stylesheet expects the icon, checking its
+ * data against its name on the way. A blob that fails the check is deleted.
+ * Returns -1 on failure.
+ */
+static int installBlob(const download *d) {
+  FILE *f = fopen(d->blob, "rb");
+  if (!f) {
+    return -1;
+  }
+  char *data = malloc(d->cachedLength ? d->cachedLength : 1);
+  if (!data) {
+    fprintf(stderr, "Could not allocate memory for \"%s\".\n", d->blob);
+    exit(EXIT_FAILURE);
+  }
+  int ok = fread(data, 1, d->cachedLength, f) == d->cachedLength && fgetc(f) == EOF;
+  fclose(f);
+
+  gchar *digest = ok ? g_compute_checksum_for_data(G_CHECKSUM_SHA256, (guchar *)data,
+                                                    d->cachedLength)
+                     : NULL;
+  ok = ok && strcmp(digest, d->cachedDigest) == 0;
+  g_free(digest);
+  if (!ok) {
+    fprintf(stderr, "Cached copy of \"%s\" is corrupt, discarding it.\n", d->url);
+    unlink(d->blob);
+    free(data);
+    return -1;
+  }
+
+  ok = writeAtomically(d->name, data, d->cachedLength) == 0;
+  free(data);
+  if (!ok) {
+    fprintf(stderr, "Could not write \"%s\".\n", d->name);
+    return -1;
+  }
+  utime(d->blob, NULL);
+  return 0;
+}
+
+static int startDownload(CURLM *multi, download *d, const fetchOptions *options) {
+  if (options->cacheDirectory) {
+    snprintf(d->temporary, sizeof(d->temporary), "%s/.download.XXXXXX", options->cacheDirectory);
+  } else {
+    snprintf(d->temporary, sizeof(d->temporary), "%s.XXXXXX", d->name);
+  }
+  int fd = makeTemporary(d->temporary);
+  if (fd < 0 || !(d->file = fdopen(fd, "wb"))) {
+    fprintf(stderr, "Could not create \"%s\".\n", d->temporary);
+    perror("mkstemp");
+    if (fd >= 0) {
+      close(fd);
+      unlink(d->temporary);
+    }
+    return -1;
+  }
+  d->checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  d->length = 0;
+
+  d->handle = curl_easy_init();
+  if (!d->handle) {
+    fprintf(stderr, "cURL failure.\n");
+    exit(EXIT_FAILURE);
+  }
+  curl_easy_setopt(d->handle, CURLOPT_URL, d->url);
+  curl_easy_setopt(d->handle, CURLOPT_WRITEDATA, d);
+  curl_easy_setopt(d->handle, CURLOPT_WRITEFUNCTION, writeCallback);
+  curl_easy_setopt(d->handle, CURLOPT_PRIVATE, d);
+  curl_easy_setopt(d->handle, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(d->handle, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(d->handle, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(d->handle, CURLOPT_CONNECTTIMEOUT, options->timeout);
+  curl_easy_setopt(d->handle, CURLOPT_TIMEOUT, options->timeout);
+
+  /*
+   * When revalidating a copy we already have, only fetch the data if it has
+   * changed since
+   */
+  if (d->cached || d->local) {
+    curl_easy_setopt(d->handle, CURLOPT_TIMECONDITION, (long)CURL_TIMECOND_IFMODSINCE);
+    curl_easy_setopt(d->handle, CURLOPT_TIMEVALUE, (long)d->validated);
+  }
+  curl_multi_add_handle(multi, d->handle);
+  if (profiling) {
+    d->started = profileClock();
+  }
+  return 0;
+}
+
+/*
+ * Store a successful download in the cache directory and copy it to where the
+ * stylesheet expects it. Returns -1 on failure.
+ */
+static int storeDownload(download *d, const fetchOptions *options) {
+  strcpy(d->cachedDigest, d->digest);
+  d->cachedLength = d->length;
+  blobPath(d->blob, sizeof(d->blob), options->cacheDirectory, d->digest, d->length);
+  if (rename(d->temporary, d->blob) != 0) {
+    perror("rename");
+    unlink(d->temporary);
+    return -1;
+  }
+  if (storeURL(options->cacheDirectory, d)) {
+    fprintf(stderr, "Could not record \"%s\" in the resource cache.\n", d->url);
+  }
+  return installBlob(d);
+}
+
+/*
+ * Move a finished download into place, or throw it away if it failed. A
+ * revalidation that fails falls back to the copy we already have. Returns -1
+ * on failure.
+ */
+static int finishDownload(CURLM *multi, download *d, CURLcode result,
+                          const fetchOptions *options) {
+  long unmet = 0;
+  if (profiling) {
+    traceAsync("download", d->url, d->started);
+  }
+  curl_easy_getinfo(d->handle, CURLINFO_CONDITION_UNMET, &unmet);
+  curl_multi_remove_handle(multi, d->handle);
+  curl_easy_cleanup(d->handle);
+  d->handle = NULL;
+
+  int failed = fclose(d->file) != 0 || result != CURLE_OK;
+  d->file = NULL;
+  snprintf(d->digest, sizeof(d->digest), "%s", g_checksum_get_string(d->checksum));
+  g_checksum_free(d->checksum);
+  d->checksum = NULL;
+  if (failed || unmet) {
+    unlink(d->temporary);
+  }
+  if (failed) {
+    fprintf(stderr, "Could not download \"%s\" from \"%s\": %s.\n", d->name, d->url,
+            result != CURLE_OK ? curl_easy_strerror(result) : "could not write file");
+    if (d->local) {
+      return 0;
+    }
+    return d->cached ? installBlob(d) : -1;
+  }
+
+  /*
+   * Not modified since it was last fetched
+   */
+  if (unmet) {
+    if (d->cached) {
+      char path[4096];
+      urlPath(path, sizeof(path), options->cacheDirectory, d->url);
+      utime(path, NULL);
+      return installBlob(d);
+    }
+    return 0;
+  }
+
+  if (options->cacheDirectory) {
+    return storeDownload(d, options);
+  }
+  if (rename(d->temporary, d->name) != 0) {
+    perror("rename");
+    unlink(d->temporary);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Decide whether an icon has to be downloaded, installing it from the cache
+ * directory if it can be. Returns 1 if it has to be downloaded, 0 if it is
+ * already in place, and -1 if it is not available.
+ */
+static int needsDownload(download *d, const fetchOptions *options) {
+  struct stat st;
+  if (stat(d->name, &st) == 0) {
+    if (!options->revalidate || options->offline) {
+      return 0;
+    }
+    d->local = 1;
+    d->validated = st.st_mtime;
+  }
+
+  if (options->cacheDirectory && lookupURL(options->cacheDirectory, d) == 0) {
+    d->local = 0;
+    d->cached = 1;
+    if (!options->revalidate || options->offline) {
+      if (installBlob(d) == 0) {
+        return 0;
+      }
+      d->cached = 0;
+    }
+  }
+
+  if (options->offline) {
+    fprintf(stderr, "\"%s\" is not available offline.\n", d->name);
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * Delete the entries whose blobs are gone from the cache directory, after
+ * blobs have been trimmed, so that entries are trimmed along with them. Also
+ * delete downloads left behind by runs that died.
+ */
+static void trimEntries(const char *directory) {
+  DIR *dir = opendir(directory);
+  if (!dir) {
+    return;
+  }
+  time_t stale = time(NULL) - STALE_DOWNLOAD_AGE;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    size_t length = strlen(entry->d_name);
+    if (strncmp(entry->d_name, ".download.", strlen(".download.")) == 0) {
+      char path[4096];
+      struct stat st;
+      snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+      if (stat(path, &st) == 0 && st.st_mtime < stale) {
+        unlink(path);
+      }
+      continue;
+    }
+    if (length < strlen(".url") || strcmp(entry->d_name + length - strlen(".url"), ".url") != 0) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+      continue;
+    }
+    char digest[DIGEST_LENGTH + 1];
+    unsigned long size;
+    char *url = readEntry(f, digest, &size);
+    fclose(f);
+
+    char blob[4096];
+    if (url) {
+      blobPath(blob, sizeof(blob), directory, digest, size);
+    }
+    if (!url || access(blob, F_OK) != 0) {
+      unlink(path);
+    }
+    free(url);
+  }
+  closedir(dir);
+}
+
+/*
+ * Find every icon referenced by the content or the stylesheet that does not
+ * exist locally, and fetch them all before rendering starts, from the cache
+ * directory if there is one and otherwise from the network. Transfers run
+ * concurrently over a bounded number of connections, and each one has a time
+ * limit. Returns the number of icons that could not be fetched.
+ */
+int prefetchIcons(cJSON *content, cJSON *stylesheet, const fetchOptions *options) {
+  downloadList list = {0};
+  collectIcons(content, &list);
+  collectIcons(stylesheet, &list);
+  if (!list.count) {
+    return 0;
+  }
+
+  if (options->cacheDirectory && mkdir(options->cacheDirectory, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create resource cache directory \"%s\".\n", options->cacheDirectory);
+    perror("mkdir");
+    exit(EXIT_FAILURE);
+  }
+
+  CURLM *multi = curl_multi_init();
+  if (!multi) {
+    fprintf(stderr, "cURL failure.\n");
+    exit(EXIT_FAILURE);
+  }
+  curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)options->connections);
+
+  int failures = 0;
+  for (int i = 0; i < list.count; i++) {
+    int needed = needsDownload(&list.downloads[i], options);
+    if (needed < 0 || (needed && startDownload(multi, &list.downloads[i], options))) {
+      failures++;
+    }
+  }
+
+  int running = 1;
+  while (running) {
+    if (curl_multi_perform(multi, &running) != CURLM_OK) {
+      fprintf(stderr, "cURL failure.\n");
+      exit(EXIT_FAILURE);
+    }
+
+    CURLMsg *message;
+    int queued;
+    while ((message = curl_multi_info_read(multi, &queued))) {
+      if (message->msg == CURLMSG_DONE) {
+        download *d;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&d);
+        if (finishDownload(multi, d, message->data.result, options)) {
+          failures++;
+        }
+      }
+    }
+
+    if (running) {
+      curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+  }
+  curl_multi_cleanup(multi);
+  free(list.downloads);
+
+  if (options->cacheDirectory) {
+    trimDirectory(options->cacheDirectory, ".blob", options->cacheLimit);
+    trimEntries(options->cacheDirectory);
+  }
+  return failures;
+}
@@ -0,0 +1,19 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+/*
+ * How icons are fetched: an optional directory to cache them in, shared
+ * between runs, and whether to use the network at all.
+ */
+typedef struct fetchOptions {
+  const char *cacheDirectory;
+  unsigned long cacheLimit;
+  int offline;
+  int revalidate;
+  int connections;
+  long timeout;
+} fetchOptions;
+
+int prefetchIcons(cJSON *content, cJSON *stylesheet, const fetchOptions *options);
+
+#endif
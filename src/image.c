@@ -0,0 +1,326 @@
+#include <cairo.h>
+#include <librsvg-2.0/librsvg/rsvg.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "image.h"
+
+/*
+ * Every PNG that has been decoded, keyed by its path. The modification time and
+ * size are kept so that a file that changes is decoded again. The cache is
+ * shared by all rendering threads.
+ */
+typedef struct image {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  cairo_surface_t *surface;
+  struct image *next;
+} image;
+
+static image *images;
+static pthread_mutex_t imagesLock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long imageHits;
+static unsigned long imageMisses;
+
+/*
+ * Decode a PNG and tag it with an identifier derived from its path and
+ * modification time, so that the PDF backend writes it out only once however
+ * many times it is painted.
+ */
+static cairo_surface_t *decodeImage(const char *path, const struct stat *st) {
+  cairo_surface_t *surface = cairo_image_surface_create_from_png(path);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    fprintf(stderr, "Could not load image \"%s\": %s.\n", path,
+            cairo_status_to_string(cairo_surface_status(surface)));
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+
+  char buffer[4096];
+  snprintf(buffer, sizeof(buffer), "%s:%ld.%09ld:%ld", path, (long)st->st_mtim.tv_sec,
+           st->st_mtim.tv_nsec, (long)st->st_size);
+  char *id = strdup(buffer);
+  if (!id) {
+    fprintf(stderr, "Could not allocate image identifier.\n");
+    exit(EXIT_FAILURE);
+  }
+  cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_UNIQUE_ID, (unsigned char *)id,
+                              strlen(id), free, id);
+  return surface;
+}
+
+/*
+ * Return the cached entry for an image, decoding it if it is new or has
+ * changed on disk. Must be called with the lock held.
+ */
+static image *getImage(const char *path) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Trying to open \"%s\".\n", path);
+    perror("stat");
+    return NULL;
+  }
+
+  image *entry = images;
+  while (entry && strcmp(entry->path, path) != 0) {
+    entry = entry->next;
+  }
+  if (entry && entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+      entry->mtime.tv_nsec == st.st_mtim.tv_nsec && entry->size == st.st_size) {
+    imageHits++;
+    return entry;
+  }
+  imageMisses++;
+
+  cairo_surface_t *surface = decodeImage(path, &st);
+  if (!surface) {
+    return NULL;
+  }
+  if (!entry) {
+    entry = calloc(1, sizeof(image));
+    if (!entry) {
+      fprintf(stderr, "Could not allocate image cache.\n");
+      exit(EXIT_FAILURE);
+    }
+    entry->path = strdup(path);
+    entry->next = images;
+    images = entry;
+  } else {
+    cairo_surface_destroy(entry->surface);
+  }
+  entry->mtime = st.st_mtim;
+  entry->size = st.st_size;
+  entry->surface = surface;
+  return entry;
+}
+
+/*
+ * Paint a PNG file at the origin of the current transformation. Returns -1 if
+ * the image could not be loaded. Cairo surfaces may not be used by several
+ * threads at once, so painting is done with the lock held.
+ */
+int paintImage(cairo_t *cr, const char *path) {
+  pthread_mutex_lock(&imagesLock);
+  image *entry = getImage(path);
+  if (entry) {
+    cairo_set_source_surface(cr, entry->surface, 0, 0);
+    cairo_paint(cr);
+  }
+  pthread_mutex_unlock(&imagesLock);
+  return entry ? 0 : -1;
+}
+
+/*
+ * Parsed SVG icons, and a recording of each size at which they have been
+ * rendered. librsvg handles may not be shared between threads, so each thread
+ * keeps its own.
+ */
+typedef struct iconSize {
+  float size;
+  cairo_surface_t *recording;
+  struct iconSize *next;
+} iconSize;
+
+typedef struct icon {
+  char *path;
+  RsvgHandle *handle;
+  iconSize *sizes;
+  struct icon *next;
+} icon;
+
+static _Thread_local icon *icons;
+static _Thread_local unsigned long iconParses;
+static _Thread_local unsigned long iconRenders;
+static _Thread_local unsigned long iconReplays;
+
+/*
+ * Return the parsed icon for a file, or NULL if it cannot be loaded. Failures
+ * are not cached, since a missing icon may be downloaded later.
+ */
+static icon *getIcon(const char *path) {
+  icon *entry = icons;
+  while (entry && strcmp(entry->path, path) != 0) {
+    entry = entry->next;
+  }
+  if (entry) {
+    return entry;
+  }
+
+  RsvgHandle *handle = rsvg_handle_new_from_file(path, NULL);
+  if (!handle) {
+    return NULL;
+  }
+  iconParses++;
+
+  entry = calloc(1, sizeof(icon));
+  if (!entry) {
+    fprintf(stderr, "Could not allocate icon cache.\n");
+    exit(EXIT_FAILURE);
+  }
+  entry->path = strdup(path);
+  entry->handle = handle;
+  entry->next = icons;
+  icons = entry;
+  return entry;
+}
+
+/*
+ * Render an icon into a recording surface of the given size.
+ */
+static cairo_surface_t *recordIcon(icon *entry, float size) {
+  cairo_rectangle_t extents = {0, 0, size, size};
+  cairo_surface_t *recording = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  cairo_t *cr = cairo_create(recording);
+
+  RsvgRectangle r;
+  r.x = 0;
+  r.y = 0;
+  r.width = size;
+  r.height = size;
+  GError *error = NULL;
+  if (!rsvg_handle_render_document(entry->handle, cr, &r, &error)) {
+    fprintf(stderr, "Icon \"%s\" could not be rendered: %s.\n", entry->path,
+            error ? error->message : "unknown error");
+    exit(EXIT_FAILURE);
+  }
+  cairo_destroy(cr);
+  iconRenders++;
+  return recording;
+}
+
+/*
+ * Paint an SVG icon at the origin of the current transformation, scaled to a
+ * square of the given size. Each file is parsed once, and each size rendered
+ * once; later uses replay the recording. Returns -1 if the file could not be
+ * loaded.
+ */
+int paintIcon(cairo_t *cr, const char *path, float size) {
+  icon *entry = getIcon(path);
+  if (!entry) {
+    return -1;
+  }
+
+  iconSize *rendered = entry->sizes;
+  while (rendered && rendered->size != size) {
+    rendered = rendered->next;
+  }
+  if (!rendered) {
+    rendered = calloc(1, sizeof(iconSize));
+    if (!rendered) {
+      fprintf(stderr, "Could not allocate icon cache.\n");
+      exit(EXIT_FAILURE);
+    }
+    rendered->size = size;
+    rendered->recording = recordIcon(entry, size);
+    rendered->next = entry->sizes;
+    entry->sizes = rendered;
+  } else {
+    iconReplays++;
+  }
+
+  cairo_set_source_surface(cr, rendered->recording, 0, 0);
+  cairo_paint(cr);
+  return 0;
+}
+
+/*
+ * Draw a stand-in for an image in draft mode: a grey box of the image's size
+ * with a cross through it, at the origin of the current transformation. The
+ * outline is a single device unit wide, whatever the transformation.
+ */
+static void paintPlaceholder(cairo_t *cr, double width, double height) {
+  cairo_save(cr);
+  cairo_rectangle(cr, 0, 0, width, height);
+  cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 0.25);
+  cairo_fill_preserve(cr);
+  cairo_move_to(cr, 0, 0);
+  cairo_line_to(cr, width, height);
+  cairo_move_to(cr, width, 0);
+  cairo_line_to(cr, 0, height);
+  cairo_identity_matrix(cr);
+  cairo_set_line_width(cr, 1);
+  cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 1);
+  cairo_stroke(cr);
+  cairo_restore(cr);
+}
+
+/*
+ * Draw a placeholder in place of a PNG file, without decoding it. Only the
+ * dimensions are read, from the header at the start of the file. Returns -1 if
+ * they could not be read.
+ */
+int paintImagePlaceholder(cairo_t *cr, const char *path) {
+  static const unsigned char signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  unsigned char header[24];
+  FILE *f = fopen(path, "rb");
+  int ok = f && fread(header, 1, sizeof(header), f) == sizeof(header) &&
+           memcmp(header, signature, sizeof(signature)) == 0 &&
+           memcmp(header + 12, "IHDR", 4) == 0;
+  if (f) {
+    fclose(f);
+  }
+  if (!ok) {
+    fprintf(stderr, "Could not read the size of image \"%s\".\n", path);
+    return -1;
+  }
+
+  /*
+   * The width and height are big endian
+   */
+  unsigned long width = (unsigned long)header[16] << 24 | header[17] << 16 | header[18] << 8 |
+                        header[19];
+  unsigned long height = (unsigned long)header[20] << 24 | header[21] << 16 | header[22] << 8 |
+                         header[23];
+  paintPlaceholder(cr, width, height);
+  return 0;
+}
+
+/*
+ * Draw a placeholder in place of an icon, which is always a square
+ */
+void paintIconPlaceholder(cairo_t *cr, float size) {
+  paintPlaceholder(cr, size, size);
+}
+
+void printImageStats() {
+  fprintf(stdout, "Images: %lu decoded, %lu reused\n", imageMisses, imageHits);
+  fprintf(stdout, "Icons: %lu parsed, %lu rendered, %lu replayed\n",
+          iconParses, iconRenders, iconReplays);
+}
+
+/*
+ * Release the icons cached by the calling thread.
+ */
+void freeIcons() {
+  while (icons) {
+    icon *next = icons->next;
+    while (icons->sizes) {
+      iconSize *nextSize = icons->sizes->next;
+      cairo_surface_destroy(icons->sizes->recording);
+      free(icons->sizes);
+      icons->sizes = nextSize;
+    }
+    g_object_unref(icons->handle);
+    free(icons->path);
+    free(icons);
+    icons = next;
+  }
+}
+
+/*
+ * Release every decoded image. Must only be called once all surfaces that
+ * they were painted onto have been finished.
+ */
+void freeImages() {
+  while (images) {
+    image *next = images->next;
+    cairo_surface_destroy(images->surface);
+    free(images->path);
+    free(images);
+    images = next;
+  }
+}
@@ -0,0 +1,12 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+int paintImage(cairo_t *cr, const char *path);
+int paintIcon(cairo_t *cr, const char *path, float size);
+int paintImagePlaceholder(cairo_t *cr, const char *path);
+void paintIconPlaceholder(cairo_t *cr, float size);
+void printImageStats();
+void freeImages();
+void freeIcons();
+
+#endif
@@ -0,0 +1,160 @@
+#include <pango/pangocairo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "include.h"
+#include "io.h"
+
+/*
+ * Every file that has been transcluded by an "INCLUDE:" directive, keyed by
+ * its path. The file is mapped once and used in place; a copy is only made if
+ * newlines have to be stripped from it. The modification time and size are
+ * kept so that a file that changes, as in watch mode, is read again. Each
+ * rendering thread has its own.
+ */
+typedef struct includedFile {
+  char *path;
+  struct timespec mtime;
+  off_t size;
+  inputFile input;
+  int valid;
+  const char *newline;
+  char *stripped;
+  struct includedFile *next;
+} includedFile;
+
+static _Thread_local includedFile *includes;
+static _Thread_local unsigned long includeHits;
+static _Thread_local unsigned long includeReads;
+
+/*
+ * Find the first newline in a buffer, and whether it has any character that
+ * can start markup. memchr runs over the buffer a vector at a time, and each
+ * search stops at its first match. Text without "<" or "&" is plain text, and
+ * never needs to be parsed to know that it is valid markup.
+ */
+static int scanText(const char *data, size_t size, const char **newline) {
+  *newline = memchr(data, '\n', size);
+  return memchr(data, '<', size) || memchr(data, '&', size);
+}
+
+/*
+ * Map a file and check it once, so that every later use can go straight to
+ * layout. Returns zero if the file is not valid markup.
+ */
+static int loadIncluded(includedFile *entry) {
+  FILE *f = fopen(entry->path, "rb");
+  if (!f) {
+    fprintf(stderr, "Trying to open \"%s\".\n", entry->path);
+    perror("fopen");
+    exit(EXIT_FAILURE);
+  }
+  mapFile(f, &entry->input);
+  fclose(f);
+
+  entry->valid = 1;
+  if (scanText(entry->input.data, entry->input.size, &entry->newline)) {
+    GError *error = NULL;
+    if (!pango_parse_markup(entry->input.data, entry->input.size, 0, NULL, NULL, NULL, &error)) {
+      fprintf(stderr, "Invalid markup in \"%s\": %s.\n", entry->path, error->message);
+      g_error_free(error);
+      entry->valid = 0;
+    }
+  }
+  return entry->valid;
+}
+
+static void unloadIncluded(includedFile *entry) {
+  unmapFile(&entry->input);
+  free(entry->stripped);
+  entry->stripped = NULL;
+}
+
+/*
+ * Return the text of an included file, and its length, which is not
+ * terminated. Newlines are replaced by spaces if asked. Returns NULL if the
+ * file is not valid markup, in which case nothing should be drawn.
+ */
+const char *readIncluded(const char *path, int stripNewlines, size_t *length) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "Trying to open \"%s\".\n", path);
+    perror("stat");
+    exit(EXIT_FAILURE);
+  }
+
+  includedFile *entry = includes;
+  while (entry && strcmp(entry->path, path) != 0) {
+    entry = entry->next;
+  }
+  if (entry && entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+      entry->mtime.tv_nsec == st.st_mtim.tv_nsec && entry->size == st.st_size) {
+    includeHits++;
+  } else {
+    if (!entry) {
+      entry = calloc(1, sizeof(includedFile));
+      if (!entry) {
+        fprintf(stderr, "Could not allocate memory for \"%s\".\n", path);
+        exit(EXIT_FAILURE);
+      }
+      entry->path = strdup(path);
+      entry->next = includes;
+      includes = entry;
+    } else {
+      unloadIncluded(entry);
+    }
+    entry->mtime = st.st_mtim;
+    entry->size = st.st_size;
+    includeReads++;
+    loadIncluded(entry);
+  }
+
+  if (!entry->valid) {
+    return NULL;
+  }
+  *length = entry->input.size;
+  if (!stripNewlines || !entry->newline) {
+    return entry->input.data;
+  }
+
+  /*
+   * The mapping is read only, so newlines are replaced in a copy that is made
+   * the first time it is needed, starting from the newline found by the scan
+   */
+  if (!entry->stripped) {
+    entry->stripped = malloc(entry->input.size);
+    if (!entry->stripped) {
+      fprintf(stderr, "Could not allocate memory for \"%s\".\n", path);
+      exit(EXIT_FAILURE);
+    }
+    memcpy(entry->stripped, entry->input.data, entry->input.size);
+    char *end = entry->stripped + entry->input.size;
+    char *p = entry->stripped + (entry->newline - entry->input.data);
+    while (p) {
+      *p++ = ' ';
+      p = memchr(p, '\n', end - p);
+    }
+  }
+  return entry->stripped;
+}
+
+/*
+ * Print out how well the include cache of the calling thread performed
+ */
+void printIncludeStats() {
+  fprintf(stdout, "Included files: %lu reads, %lu reused\n", includeReads, includeHits);
+}
+
+void freeIncludes() {
+  while (includes) {
+    includedFile *next = includes->next;
+    unloadIncluded(includes);
+    free(includes->path);
+    free(includes);
+    includes = next;
+  }
+  includeHits = 0;
+  includeReads = 0;
+}
@@ -0,0 +1,10 @@
+#ifndef INCLUDE_H
+#define INCLUDE_H
+
+#include <stddef.h>
+
+const char *readIncluded(const char *path, int stripNewlines, size_t *length);
+void printIncludeStats();
+void freeIncludes();
+
+#endif
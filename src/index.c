@@ -0,0 +1,251 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+/*
+ * Every key in an indexed tree is replaced by a pointer into a table of
+ * interned strings, so that two keys are equal exactly when their pointers
+ * are.
+ */
+static char **strings;
+static size_t stringsSize;
+static size_t stringsCount;
+
+/*
+ * Each indexed object node gets its own hash table of children, keyed by the
+ * interned key pointer. The tables themselves are found through a second hash
+ * table keyed by the address of the node.
+ */
+typedef struct nodeIndex {
+  cJSON *node;
+  size_t size;
+  cJSON **slots;
+  void *data;
+  unsigned long digest;
+} nodeIndex;
+
+static nodeIndex *nodes;
+static size_t nodesSize;
+static size_t nodesCount;
+
+static void *allocate(size_t count, size_t size) {
+  void *p = calloc(count, size);
+  if (!p) {
+    fprintf(stderr, "Could not allocate index.\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static unsigned long hashString(const char *s) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static unsigned long hashPointer(const void *p) {
+  return ((uintptr_t)p >> 3) * 11400714819323198485UL;
+}
+
+static char **findString(char **table, size_t size, const char *s) {
+  size_t i = hashString(s) & (size - 1);
+  while (table[i]) {
+    if (table[i] == s || strcmp(table[i], s) == 0) {
+      break;
+    }
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+/*
+ * Return the interned copy of a string, adding it to the table if necessary.
+ */
+const char *intern(const char *s) {
+  if ((stringsCount + 1) * 2 > stringsSize) {
+    size_t size = stringsSize ? stringsSize * 2 : 256;
+    char **table = allocate(size, sizeof(char *));
+    for (size_t i = 0; i < stringsSize; i++) {
+      if (strings[i]) {
+        *findString(table, size, strings[i]) = strings[i];
+      }
+    }
+    free(strings);
+    strings = table;
+    stringsSize = size;
+  }
+
+  char **slot = findString(strings, stringsSize, s);
+  if (!*slot) {
+    *slot = strdup(s);
+    stringsCount++;
+  }
+  return *slot;
+}
+
+/*
+ * Return the interned copy of a string, or NULL if no indexed tree contains
+ * it.
+ */
+const char *lookupInterned(const char *s) {
+  if (!strings) {
+    return NULL;
+  }
+  return *findString(strings, stringsSize, s);
+}
+
+static nodeIndex *findNode(nodeIndex *table, size_t size, const cJSON *node) {
+  size_t i = hashPointer(node) & (size - 1);
+  while (table[i].node && table[i].node != node) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+static cJSON **findSlot(cJSON **slots, size_t size, const char *key) {
+  size_t i = hashPointer(key) & (size - 1);
+  while (slots[i] && slots[i]->string != key) {
+    i = (i + 1) & (size - 1);
+  }
+  return &slots[i];
+}
+
+static void addNode(cJSON *tree, size_t children) {
+  if ((nodesCount + 1) * 2 > nodesSize) {
+    size_t size = nodesSize ? nodesSize * 2 : 256;
+    nodeIndex *table = allocate(size, sizeof(nodeIndex));
+    for (size_t i = 0; i < nodesSize; i++) {
+      if (nodes[i].node) {
+        *findNode(table, size, nodes[i].node) = nodes[i];
+      }
+    }
+    free(nodes);
+    nodes = table;
+    nodesSize = size;
+  }
+
+  nodeIndex *entry = findNode(nodes, nodesSize, tree);
+  if (entry->node) {
+    free(entry->slots);
+  } else {
+    nodesCount++;
+  }
+
+  size_t size = 4;
+  while (size < children * 2) {
+    size *= 2;
+  }
+  entry->node = tree;
+  entry->size = size;
+  entry->digest = 0;
+  entry->slots = allocate(size, sizeof(cJSON *));
+
+  /*
+   * Like a linear scan, the first of several identical keys wins.
+   */
+  for (cJSON *child = tree->child; child; child = child->next) {
+    cJSON **slot = findSlot(entry->slots, size, child->string);
+    if (!*slot) {
+      *slot = child;
+    }
+  }
+}
+
+/*
+ * Intern the keys of a tree and build a hash table of children for every
+ * object node, so that lookups by key no longer need to scan siblings. Should
+ * be called once after the tree is parsed, and before it is modified.
+ */
+void indexTree(cJSON *tree) {
+  if (!cJSON_IsObject(tree)) {
+    return;
+  }
+
+  size_t children = 0;
+  for (cJSON *child = tree->child; child; child = child->next) {
+    if (child->string && !(child->type & cJSON_StringIsConst)) {
+      char *key = child->string;
+      child->string = (char *)intern(key);
+      child->type |= cJSON_StringIsConst;
+      cJSON_free(key);
+    }
+    indexTree(child);
+    children++;
+  }
+
+  if (children) {
+    addNode(tree, children);
+  }
+}
+
+/*
+ * Look up a child of an indexed tree by key. Returns zero if the tree has not
+ * been indexed, in which case the caller has to search it by hand.
+ */
+int lookupIndex(cJSON *tree, const char *str, cJSON **result) {
+  if (!nodes) {
+    return 0;
+  }
+  nodeIndex *entry = findNode(nodes, nodesSize, tree);
+  if (!entry->node) {
+    return 0;
+  }
+
+  const char *key = lookupInterned(str);
+  *result = key ? *findSlot(entry->slots, entry->size, key) : NULL;
+  return 1;
+}
+
+static nodeIndex *lookupNode(const cJSON *tree) {
+  if (!nodes) {
+    return NULL;
+  }
+  nodeIndex *entry = findNode(nodes, nodesSize, tree);
+  return entry->node ? entry : NULL;
+}
+
+/*
+ * Return a slot in which other modules can attach data to an indexed node, or
+ * NULL if the node has not been indexed.
+ */
+void **nodeData(cJSON *tree) {
+  nodeIndex *entry = lookupNode(tree);
+  return entry ? &entry->data : NULL;
+}
+
+/*
+ * Return a slot in which a digest of an indexed node and everything below it
+ * can be kept, or NULL if the node has not been indexed.
+ */
+unsigned long *nodeDigest(cJSON *tree) {
+  nodeIndex *entry = lookupNode(tree);
+  return entry ? &entry->digest : NULL;
+}
+
+/*
+ * Release the index and all interned strings. Indexed trees must be deleted
+ * first, since their keys point into the interned string table.
+ */
+void freeIndex() {
+  for (size_t i = 0; i < nodesSize; i++) {
+    free(nodes[i].slots);
+  }
+  free(nodes);
+  nodes = NULL;
+  nodesSize = 0;
+  nodesCount = 0;
+
+  for (size_t i = 0; i < stringsSize; i++) {
+    free(strings[i]);
+  }
+  free(strings);
+  strings = NULL;
+  stringsSize = 0;
+  stringsCount = 0;
+}
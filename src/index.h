@@ -0,0 +1,14 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <cjson/cJSON.h>
+
+const char *intern(const char *s);
+const char *lookupInterned(const char *s);
+void indexTree(cJSON *tree);
+int lookupIndex(cJSON *tree, const char *str, cJSON **result);
+void **nodeData(cJSON *tree);
+unsigned long *nodeDigest(cJSON *tree);
+void freeIndex();
+
+#endif
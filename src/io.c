@@ -1,63 +1,223 @@
+#include <dirent.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "io.h"
 
 /*
- * Generate a checksum value from a file stream.
+ * Bring the whole of an input file into memory in one pass. Regular files are
+ * mapped; anything that cannot be mapped, such as a pipe, is read into the
+ * heap instead.
  */
-unsigned int checksumFile(FILE *f) {
-  fseek(f, 0, SEEK_END);
-  int size = ftell(f);
-  rewind(f);
+void mapFile(FILE *f, inputFile *input) {
+  struct stat st;
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = 0;
 
-  /*
-   * Read the file data into memory
-   */
-  unsigned char buffer[size + 1];
-  buffer[size] = 0;
-  int ret = fread(buffer, 1, size, f);
-  if (ret != size) {
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (data != MAP_FAILED) {
+      input->data = data;
+      input->size = st.st_size;
+      input->mapped = 1;
+      return;
+    }
+  }
+
+  size_t capacity = 0;
+  char *data = NULL;
+  while (1) {
+    if (input->size == capacity) {
+      capacity = capacity ? capacity * 2 : 65536;
+      data = realloc(data, capacity);
+      if (!data) {
+        fprintf(stderr, "Could not allocate memory for input file.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    size_t ret = fread(data + input->size, 1, capacity - input->size, f);
+    input->size += ret;
+    if (ret == 0) {
+      break;
+    }
+  }
+  if (ferror(f)) {
     fprintf(stderr, "Could not read the expected number of bytes.\n");
     exit(EXIT_FAILURE);
   }
-  rewind(f);
-
-  unsigned long crc = crc32(0L, Z_NULL, 0);
-  crc = crc32(crc, buffer, size);
-
-  return crc;
+  input->data = data;
 }
 
-cJSON *readJSONFile(FILE *f) {
+void unmapFile(inputFile *input) {
+  if (input->mapped) {
+    munmap((void *)input->data, input->size);
+  } else {
+    free((void *)input->data);
+  }
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = 0;
+}
 
-  /*
-   * Get the size of the file so that we know how large we need to make the
-   * buffer
-   */
-  fseek(f, 0, SEEK_END);
-  int size = ftell(f);
-  rewind(f);
+unsigned int checksumData(const inputFile *input) {
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  const unsigned char *data = (const unsigned char *)input->data;
+  size_t remaining = input->size;
 
   /*
-   * Read the JSON data into memory
+   * crc32 takes its length as an unsigned int, so very large files are
+   * checksummed in pieces
    */
-  char buffer[size + 1];
-  buffer[size] = 0;
-  int ret = fread(buffer, 1, size, f);
-  if (ret != size) {
-    fprintf(stderr, "Could not read the expected number of bytes.\n");
-    exit(EXIT_FAILURE);
+  while (remaining) {
+    unsigned int chunk = remaining > (1U << 30) ? (1U << 30) : remaining;
+    crc = crc32(crc, data, chunk);
+    data += chunk;
+    remaining -= chunk;
   }
+  return crc;
+}
 
-  /*
-   * Parse the data using cJSON
-   */
-  cJSON *cjson = cJSON_Parse(buffer);
+/*
+ * Parse an input file, reporting any syntax error. Returns NULL if the file is
+ * not valid JSON.
+ */
+cJSON *tryParseJSON(const inputFile *input) {
+  cJSON *cjson = cJSON_ParseWithLength(input->data, input->size);
   if (!cjson) {
     const char *error_ptr = cJSON_GetErrorPtr();
     if (error_ptr) {
-      fprintf(stderr, "Error before: %s\n", error_ptr);
+      fprintf(stderr, "Error before: %.*s\n",
+              (int)(input->data + input->size - error_ptr), error_ptr);
     }
-    cJSON_Delete(cjson);
+  }
+  return cjson;
+}
+
+cJSON *parseJSON(const inputFile *input) {
+  cJSON *cjson = tryParseJSON(input);
+  if (!cjson) {
     exit(EXIT_FAILURE);
   }
   return cjson;
 }
+
+/*
+ * Generate a checksum value from a file stream.
+ */
+unsigned int checksumFile(FILE *f) {
+  inputFile input;
+  mapFile(f, &input);
+  rewind(f);
+  unsigned int crc = checksumData(&input);
+  unmapFile(&input);
+  return crc;
+}
+
+cJSON *readJSONFile(FILE *f) {
+  inputFile input;
+  mapFile(f, &input);
+  cJSON *cjson = parseJSON(&input);
+  unmapFile(&input);
+  return cjson;
+}
+
+/*
+ * The mode that new files get. mkstemp always creates files that only their
+ * owner can read, so temporary files are given this mode before they are
+ * renamed into place. The umask can only be read by changing it, so it is read
+ * once at startup, before any other threads start.
+ */
+static mode_t fileMode = 0600;
+
+void readUmask() {
+  mode_t mask = umask(0);
+  umask(mask);
+  fileMode = 0666 & ~mask;
+}
+
+/*
+ * Create a temporary file from a mkstemp template, with the mode that any
+ * other new file would get. Returns its descriptor, or -1 on failure, in which
+ * case no file is left behind.
+ */
+int makeTemporary(char *template) {
+  int fd = mkstemp(template);
+  if (fd >= 0 && fchmod(fd, fileMode) != 0) {
+    close(fd);
+    unlink(template);
+    return -1;
+  }
+  return fd;
+}
+
+typedef struct cacheFile {
+  char name[256];
+  time_t mtime;
+  off_t size;
+} cacheFile;
+
+static int compareAge(const void *a, const void *b) {
+  time_t x = ((const cacheFile *)a)->mtime;
+  time_t y = ((const cacheFile *)b)->mtime;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Delete the least recently used files with the given suffix from a cache
+ * directory until their total size is under the limit. Files are aged by
+ * their modification time, which caches update on every hit.
+ */
+void trimDirectory(const char *path, const char *suffix, unsigned long limit) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+
+  cacheFile *files = NULL;
+  size_t count = 0;
+  size_t size = 0;
+  unsigned long total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    size_t length = strlen(entry->d_name);
+    if (length < strlen(suffix) || length >= sizeof(files->name) ||
+        strcmp(entry->d_name + length - strlen(suffix), suffix) != 0) {
+      continue;
+    }
+    char filename[4096];
+    struct stat st;
+    snprintf(filename, sizeof(filename), "%s/%s", path, entry->d_name);
+    if (stat(filename, &st) != 0) {
+      continue;
+    }
+    if (count == size) {
+      size = size ? size * 2 : 256;
+      files = realloc(files, size * sizeof(cacheFile));
+      if (!files) {
+        fprintf(stderr, "Could not allocate cache listing.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    strcpy(files[count].name, entry->d_name);
+    files[count].mtime = st.st_mtime;
+    files[count].size = st.st_size;
+    total += st.st_size;
+    count++;
+  }
+  closedir(dir);
+
+  if (total > limit) {
+    qsort(files, count, sizeof(cacheFile), compareAge);
+    for (size_t i = 0; i < count && total > limit; i++) {
+      char filename[4096];
+      snprintf(filename, sizeof(filename), "%s/%s", path, files[i].name);
+      if (unlink(filename) == 0) {
+        total -= files[i].size;
+      }
+    }
+  }
+  free(files);
+}
@@ -6,7 +6,24 @@
 #include <stdlib.h>
 #include <zlib.h>
 
+/*
+ * The contents of an input file, either mapped or read into the heap.
+ */
+typedef struct inputFile {
+  const char *data;
+  size_t size;
+  int mapped;
+} inputFile;
+
+void mapFile(FILE *f, inputFile *input);
+void unmapFile(inputFile *input);
+unsigned int checksumData(const inputFile *input);
+cJSON *tryParseJSON(const inputFile *input);
+cJSON *parseJSON(const inputFile *input);
 unsigned int checksumFile(FILE *f);
 cJSON *readJSONFile(FILE *f);
+void readUmask();
+int makeTemporary(char *template);
+void trimDirectory(const char *path, const char *suffix, unsigned long limit);
 
 #endif
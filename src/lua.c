@@ -8,27 +8,139 @@
 #include <zlib.h>
 
 #include "dsml2.h"
+#include "expr.h"
 #include "io.h"
 #include "lua.h"
+#include "profile.h"
 #include "render.h"
 #include "style.h"
 #include "traverse.h"
 
 /*
- * Retrieve a floating point value by evaluating a string
+ * Key in the Lua registry under which compiled expressions are stored.
  */
-float luaGetVal(lua_State *L, char *s) {
-  lua_getglobal(L, "eval");
-  lua_pushstring(L, s);
-  int error = lua_pcall(L, 1, 1, 0);
-  float ret = lua_tonumber(L, -1);
+#define EXPRESSION_CACHE "dsml2.expressions"
+
+/*
+ * Key in the Lua registry under which the constants that have not been
+ * evaluated yet are stored, and how deeply constants may depend on each other.
+ */
+#define CONSTANT_SOURCES "dsml2.constants"
+#define CONSTANT_DEPTH 128
+
+/*
+ * Statistics about how many expressions were evaluated natively, and how often
+ * the expression cache was able to skip the compilation step for the rest.
+ */
+static unsigned long nativeEvaluations;
+static unsigned long luaEvaluations;
+static unsigned long expressionCacheHits;
+static unsigned long expressionCacheMisses;
+
+/*
+ * The Lua state that constants are evaluated in for the fast path, and the
+ * constants that are being evaluated, innermost last.
+ */
+static _Thread_local lua_State *resolving;
+static _Thread_local const char *pending[CONSTANT_DEPTH];
+static _Thread_local int pendingCount;
+static unsigned long constantEvaluations;
+
+/*
+ * Evaluate an expression string and return the numeric result. Plain
+ * arithmetic over numbers and constants is evaluated natively. Everything else
+ * is compiled by Lua at most once per Lua state: the resulting function is kept
+ * in a registry table keyed by the expression text, so repeated expressions
+ * only cost a single call. Cause program exit on invalid input.
+ */
+static double evaluate(lua_State *L, const char *s) {
+  double ret;
+  resolving = L;
+  if (evalArithmetic(s, &ret)) {
+    nativeEvaluations++;
+    return ret;
+  }
+  luaEvaluations++;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, EXPRESSION_CACHE);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, EXPRESSION_CACHE);
+  }
+
+  lua_getfield(L, -1, s);
+  if (lua_isfunction(L, -1)) {
+    expressionCacheHits++;
+  } else {
+    expressionCacheMisses++;
+    lua_pop(L, 1);
+
+    const char *chunk = lua_pushfstring(L, "return %s", s);
+    if (luaL_loadbuffer(L, chunk, strlen(chunk), s)) {
+      fprintf(stderr, "%s\n", lua_tostring(L, -1));
+      exit(EXIT_FAILURE);
+    }
+    lua_remove(L, -2);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, s);
+  }
+
+  int error = lua_pcall(L, 0, 1, 0);
   if (error) {
     fprintf(stderr, "%s\n", lua_tostring(L, -1));
     exit(EXIT_FAILURE);
   }
+  ret = lua_tonumber(L, -1);
+  lua_pop(L, 2);
   return ret;
 }
 
+double luaEvalString(lua_State *L, const char *s) {
+  if (!profiling) {
+    return evaluate(L, s);
+  }
+  countEvent(COUNT_EVALUATIONS);
+  double start = profileClock();
+  double ret = evaluate(L, s);
+  traceSpan("luaEval", s, start);
+  return ret;
+}
+
+/*
+ * Print out how expressions were evaluated and the hit rate of the expression
+ * cache
+ */
+void printExpressionStats() {
+  fprintf(stdout, "Expressions: %lu evaluated natively, %lu fell back to Lua\n",
+          nativeEvaluations, luaEvaluations);
+  unsigned long total = expressionCacheHits + expressionCacheMisses;
+  fprintf(stdout, "Expression cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+          expressionCacheHits, expressionCacheMisses,
+          total ? 100. * expressionCacheHits / total : 0.);
+}
+
+/*
+ * Create and initialize a Lua state
+ */
+lua_State *newLuaState() {
+  lua_State *L = luaL_newstate();
+  if (!L) {
+    fprintf(stderr, "Could not create Lua state.\n");
+    exit(EXIT_FAILURE);
+  }
+  luaL_openlibs(L);
+  return L;
+}
+
+/*
+ * Retrieve a floating point value by evaluating a string
+ */
+float luaGetVal(lua_State *L, char *s) {
+  return luaEvalString(L, s);
+}
+
 /*
  * Set a floating point variable based on a Lua string
  */
@@ -39,9 +151,7 @@ void setOption(cJSON *parentElement, lua_State *L, char *str, float *f) {
       *f = luaGetVal(L, node->valuestring);
       return;
     } else if (cJSON_IsNumber(node)) {
-      char buf[256];
-      snprintf(buf, 255, "%f;", node->valuedouble);
-      *f = luaGetVal(L, buf);
+      *f = node->valuedouble;
       return;
     } else {
       fprintf(stderr, "JSON node unknown format.\n");
@@ -60,43 +170,182 @@ void applyOptions(cJSON *stylesheet, lua_State *L, options *options) {
   if (optionsElement) {
     setOption(optionsElement, L, "pageWidth", &options->pageWidth);
     setOption(optionsElement, L, "pageHeight", &options->pageHeight);
+    setOption(optionsElement, L, "pageMargin", &options->pageMargin);
+    setOption(optionsElement, L, "flow", &options->flow);
   }
 }
 
 /*
- * Evaluate all of the constants in the "_constants" section for use throughout
- * the document
+ * The __index metamethod of the global table. The registry holds the constants
+ * that have not been evaluated yet, keyed by name, with their expression or
+ * number. When an undefined global is one of them, it is evaluated, stored as a
+ * global and taken out of the registry table, so that this is only ever called
+ * once for it.
  */
-void collectConstants(cJSON *stylesheet, lua_State *L) {
-  cJSON *styleElement = find(stylesheet, "_constants");
-  if (styleElement) {
-    cJSON *node = NULL;
-
-    node = styleElement->child;
-    while (1) {
-      if (!node) {
-        break;
-      }
+static int lazyConstant(lua_State *L) {
+  if (lua_type(L, 2) != LUA_TSTRING) {
+    return 0;
+  }
+  const char *name = lua_tostring(L, 2);
 
-      /*
-       * Evaluate a string that sets up some global variables
-       */
-      char buf[256];
-      if (cJSON_IsString(node)) {
-        snprintf(buf, 255, "%s = %s;", node->string, node->valuestring);
-      } else if (cJSON_IsNumber(node)) {
-        snprintf(buf, 255, "%s = %f;", node->string, node->valuedouble);
-      } else {
-        fprintf(stderr, "JSON node unknown format.\n");
-        exit(EXIT_FAILURE);
+  /*
+   * A constant that is used while it is being evaluated depends on itself
+   */
+  for (int i = 0; i < pendingCount; i++) {
+    if (strcmp(pending[i], name) == 0) {
+      fprintf(stderr, "Constant \"%s\" depends on itself:", name);
+      for (int j = i; j < pendingCount; j++) {
+        fprintf(stderr, " %s ->", pending[j]);
       }
-      int error = luaL_loadbuffer(L, buf, strlen(buf), "") || lua_pcall(L, 0, 0, 0);
-      if (error) {
+      fprintf(stderr, " %s.\n", name);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  lua_getfield(L, LUA_REGISTRYINDEX, CONSTANT_SOURCES);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1)) {
+    return 1;
+  }
+  if (pendingCount == CONSTANT_DEPTH) {
+    fprintf(stderr, "Constant \"%s\" depends on constants nested too deeply.\n", name);
+    exit(EXIT_FAILURE);
+  }
+  pending[pendingCount++] = name;
+  constantEvaluations++;
+
+  /*
+   * Evaluate the expression, natively if it is plain arithmetic. Anything that
+   * it uses is evaluated first, through this function.
+   */
+  double value;
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    const char *source = lua_tostring(L, -1);
+    resolving = L;
+    if (evalArithmetic(source, &value)) {
+      lua_pushnumber(L, value);
+    } else {
+      const char *chunk = lua_pushfstring(L, "return %s", source);
+      if (luaL_loadbuffer(L, chunk, strlen(chunk), name) || lua_pcall(L, 0, 1, 0)) {
         fprintf(stderr, "%s\n", lua_tostring(L, -1));
         exit(EXIT_FAILURE);
       }
+      lua_remove(L, -2);
+    }
+  } else {
+    lua_pushvalue(L, -1);
+  }
+  pendingCount--;
+
+  /*
+   * Keep the result as a global, and a native copy of numeric constants for
+   * the arithmetic fast path
+   */
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, 1);
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    setConstant(name, lua_tonumber(L, -1));
+  }
+  lua_pushvalue(L, 2);
+  lua_pushnil(L);
+  lua_rawset(L, -5);
+  return 1;
+}
+
+/*
+ * Evaluate a constant that the arithmetic fast path has come across for the
+ * first time, in the Lua state of the calling thread
+ */
+static int resolveConstant(const char *name, size_t length, double *value) {
+  lua_State *L = resolving;
+  if (!L) {
+    return 0;
+  }
+  lua_getfield(L, LUA_REGISTRYINDEX, CONSTANT_SOURCES);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_pushlstring(L, name, length);
+  lua_rawget(L, -2);
+  int found = !lua_isnil(L, -1);
+  lua_pop(L, 2);
+  if (!found) {
+    return 0;
+  }
 
-      node = node->next;
+  lua_pushglobaltable(L);
+  lua_pushlstring(L, name, length);
+  lua_gettable(L, -2);
+  found = lua_type(L, -1) == LUA_TNUMBER;
+  if (found) {
+    *value = lua_tonumber(L, -1);
+  }
+  lua_pop(L, 2);
+  return found;
+}
+
+/*
+ * Set up the constants in the "_constants" section for use throughout the
+ * document. Nothing is evaluated here: each constant is evaluated the first
+ * time an expression uses it, after the constants that it uses in turn, so
+ * they may appear in any order and the ones that are never used cost nothing.
+ */
+void collectConstants(cJSON *stylesheet, lua_State *L) {
+  cJSON *constantsElement = find(stylesheet, "_constants");
+  setConstantResolver(resolveConstant);
+
+  lua_newtable(L);
+  lua_pushglobaltable(L);
+  for (cJSON *node = constantsElement ? constantsElement->child : NULL; node; node = node->next) {
+    if (cJSON_IsString(node)) {
+      lua_pushstring(L, node->valuestring);
+    } else if (cJSON_IsNumber(node)) {
+      lua_pushnumber(L, node->valuedouble);
+    } else {
+      fprintf(stderr, "JSON node unknown format.\n");
+      exit(EXIT_FAILURE);
+    }
+    lua_setfield(L, -3, node->string);
+
+    /*
+     * Constants take the place of any global with the same name
+     */
+    lua_pushnil(L);
+    lua_setfield(L, -2, node->string);
+  }
+
+  lua_newtable(L);
+  lua_pushcfunction(L, lazyConstant);
+  lua_setfield(L, -2, "__index");
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+  lua_setfield(L, LUA_REGISTRYINDEX, CONSTANT_SOURCES);
+}
+
+/*
+ * Print out how many constants were evaluated, and the ones that were never
+ * used by the document, which could be removed from the stylesheet
+ */
+void printConstantStats(lua_State *L) {
+  lua_getfield(L, LUA_REGISTRYINDEX, CONSTANT_SOURCES);
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+  int unused = 0;
+  for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+    unused++;
+  }
+  fprintf(stdout, "Constants: %lu evaluated, %d never used\n", constantEvaluations, unused);
+  if (unused) {
+    fprintf(stdout, "Unused constants:");
+    for (lua_pushnil(L); lua_next(L, -2); lua_pop(L, 1)) {
+      fprintf(stdout, " %s", lua_tostring(L, -2));
     }
+    fprintf(stdout, "\n");
   }
+  lua_pop(L, 1);
 }
@@ -1,14 +1,24 @@
 #ifndef LUA_H
 #define LUA_H
 
+/*
+ * Page properties from the "_options" element. When `flow` is non-zero, text
+ * that runs past the bottom margin of a page continues on the next one.
+ */
 typedef struct options {
   float pageWidth;
   float pageHeight;
+  float pageMargin;
+  float flow;
 } options;
 
+lua_State *newLuaState();
+double luaEvalString(lua_State *L, const char *s);
+void printExpressionStats();
 float luaGetVal(lua_State *L, char *s);
 void setOption(cJSON *parentElement, lua_State *L, char *str, float *f);
 void applyOptions(cJSON *stylesheet, lua_State *L, options *options);
 void collectConstants(cJSON *stylesheet, lua_State *L);
+void printConstantStats(lua_State *L);
 
 #endif
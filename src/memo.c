@@ -0,0 +1,424 @@
+#include <cairo.h>
+#include <cjson/cJSON.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "memo.h"
+#include "render.h"
+
+/*
+ * Limits on the subtrees that each rendering thread keeps track of, and on how
+ * many of them it keeps recordings of.
+ */
+#define SUBTREE_BUCKETS 4096
+#define SUBTREE_LIMIT 65536
+#define SUBTREE_RECORDING_LIMIT 4096
+
+/*
+ * A content subtree, keyed by 64-bit digests of its content, of the stylesheet
+ * subtree it is drawn with, and of the style it inherits apart from its
+ * position. Once the same subtree has been seen twice, it is drawn into a
+ * recording surface with its origin at zero, and every later occurrence
+ * replays the recording at its own position.
+ */
+struct subtree {
+  unsigned long content;
+  unsigned long stylesheet;
+  unsigned long style;
+  unsigned long seen;
+  unsigned int generation;
+  cairo_surface_t *recording;
+  subtree *chain;
+};
+
+typedef struct subtreeCache {
+  subtree **buckets;
+  unsigned long count;
+  unsigned long recordings;
+  unsigned int generation;
+  unsigned long hits;
+  unsigned long uncacheable;
+} subtreeCache;
+
+static _Thread_local subtreeCache cache;
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+/*
+ * Digests of subtrees. An indexed node that has not been digested yet keeps
+ * zero, and one marks a subtree that can never be reused, so digests that
+ * happen to be either are moved out of the way.
+ */
+#define UNDIGESTED 0UL
+#define UNCACHEABLE 1UL
+
+static unsigned long hashBytes(unsigned long hash, const void *p, size_t length) {
+  const unsigned char *bytes = p;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+static unsigned long hashString(unsigned long hash, const char *s) {
+  return hashBytes(hash, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static unsigned long hashNode(cJSON *node) {
+  int type = node->type & 0xff;
+  unsigned long hash = hashString(FNV_OFFSET, node->string);
+  hash = hashBytes(hash, &type, sizeof(type));
+  if (cJSON_IsString(node)) {
+    hash = hashString(hash, node->valuestring);
+  } else if (cJSON_IsNumber(node)) {
+    hash = hashBytes(hash, &node->valuedouble, sizeof(node->valuedouble));
+  }
+  return hash;
+}
+
+/*
+ * Digests of the nodes of a content tree that has not been indexed, such as a
+ * batch record or a streamed member, kept by each rendering thread for the
+ * tree it is drawing. An open addressed table keyed by node.
+ */
+typedef struct recordDigest {
+  cJSON *node;
+  unsigned long digest;
+} recordDigest;
+
+typedef struct recordDigests {
+  recordDigest *slots;
+  size_t size;
+} recordDigests;
+
+static _Thread_local recordDigests record;
+
+/*
+ * Find the slot of a node in the table, or claim one for it if `insert` is
+ * set. Returns NULL if the node is not in the table.
+ */
+static unsigned long *recordSlot(cJSON *node, int insert) {
+  if (!record.size) {
+    return NULL;
+  }
+  size_t i = ((uintptr_t)node >> 4) * FNV_PRIME & (record.size - 1);
+  while (record.slots[i].node && record.slots[i].node != node) {
+    i = (i + 1) & (record.size - 1);
+  }
+  if (!record.slots[i].node) {
+    if (!insert) {
+      return NULL;
+    }
+    record.slots[i].node = node;
+  }
+  return &record.slots[i].digest;
+}
+
+/*
+ * Where the digest of a node is kept: with the node in the index, or in the
+ * table of the tree being drawn. Only nodes with children need one, since any
+ * other node is digested as quickly as it is looked up.
+ */
+static unsigned long *digestSlot(cJSON *node, int insert) {
+  unsigned long *slot = nodeDigest(node);
+  if (!slot && node->child) {
+    slot = recordSlot(node, insert);
+  }
+  return slot;
+}
+
+static unsigned long countParents(cJSON *node) {
+  unsigned long count = node->child ? 1 : 0;
+  for (cJSON *child = node->child; child; child = child->next) {
+    count += countParents(child);
+  }
+  return count;
+}
+
+static unsigned long finishDigest(unsigned long hash) {
+  return hash == UNDIGESTED || hash == UNCACHEABLE ? 2 : hash;
+}
+
+/*
+ * Digest a content node from its own value and the digests of its children.
+ * Text that is replaced at render time is digested together with what it
+ * depends on. A subtree can never be reused if it breaks a page, since pages
+ * cannot be broken inside a recording, or shows the current date. Indexed
+ * nodes keep their digest once it is stored, so that each subtree is only
+ * walked once.
+ */
+static unsigned long digestContent(cJSON *node, int store) {
+  unsigned long *slot = digestSlot(node, store);
+  if (slot && *slot != UNDIGESTED) {
+    return *slot;
+  }
+  if (isPageBreak(node)) {
+    return UNCACHEABLE;
+  }
+  unsigned long hash = hashNode(node);
+  if (cJSON_IsString(node)) {
+    const char *s = node->valuestring;
+    if (strcmp(s, "CURRENT_DATE") == 0) {
+      return UNCACHEABLE;
+    }
+    if (strcmp(s, "REV") == 0) {
+      unsigned int checksum = getContentChecksum();
+      hash = hashBytes(hash, &checksum, sizeof(checksum));
+    } else if (strncmp(s, "INCLUDE:", strlen("INCLUDE:")) == 0) {
+      struct stat st;
+      if (stat(s + strlen("INCLUDE:"), &st) == 0) {
+        hash = hashBytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+        hash = hashBytes(hash, &st.st_size, sizeof(st.st_size));
+      }
+    }
+  }
+
+  int cacheable = 1;
+  for (cJSON *child = node->child; child; child = child->next) {
+    unsigned long digest = digestContent(child, store);
+    if (digest == UNCACHEABLE) {
+      cacheable = 0;
+      if (!store) {
+        break;
+      }
+    }
+    hash = hashBytes(hash, &digest, sizeof(digest));
+  }
+  hash = cacheable ? finishDigest(hash) : UNCACHEABLE;
+  if (slot && store) {
+    *slot = hash;
+  }
+  return hash;
+}
+
+/*
+ * Digest a stylesheet node in the same way. A subtree that sets a link can
+ * never be reused, since links are lost when a recording is replayed.
+ */
+static unsigned long digestStylesheet(cJSON *node, int store) {
+  unsigned long *slot = nodeDigest(node);
+  if (slot && *slot != UNDIGESTED) {
+    return *slot;
+  }
+  if (node->string && strcmp(node->string, "URI") == 0) {
+    return UNCACHEABLE;
+  }
+  unsigned long hash = hashNode(node);
+  int cacheable = 1;
+  for (cJSON *child = node->child; child; child = child->next) {
+    unsigned long digest = digestStylesheet(child, store);
+    if (digest == UNCACHEABLE) {
+      cacheable = 0;
+      if (!store) {
+        break;
+      }
+    }
+    hash = hashBytes(hash, &digest, sizeof(digest));
+  }
+  hash = cacheable ? finishDigest(hash) : UNCACHEABLE;
+  if (slot && store) {
+    *slot = hash;
+  }
+  return hash;
+}
+
+/*
+ * Digest every indexed subtree of both trees, bottom-up, so that looking up a
+ * subtree while rendering never has to walk it. Must be called after the trees
+ * are indexed and before any rendering thread starts.
+ */
+void digestTrees(cJSON *content, cJSON *stylesheet) {
+  if (content) {
+    digestContent(content, 1);
+  }
+  if (stylesheet) {
+    digestStylesheet(stylesheet, 1);
+  }
+}
+
+/*
+ * Digest a content tree that has not been indexed, such as a batch record or a
+ * streamed member, bottom-up, before the calling thread draws it. Replaces the
+ * digests of the previous tree. Passing NULL forgets them, and must be done
+ * before the tree is freed.
+ */
+void digestRecord(cJSON *content) {
+  unsigned long count = content ? countParents(content) : 0;
+  size_t size = 16;
+  while (size < 2 * count) {
+    size *= 2;
+  }
+  if (size > record.size) {
+    free(record.slots);
+    record.slots = malloc(size * sizeof(recordDigest));
+    if (!record.slots) {
+      fprintf(stderr, "Could not allocate subtree digests.\n");
+      exit(EXIT_FAILURE);
+    }
+    record.size = size;
+  }
+  memset(record.slots, 0, record.size * sizeof(recordDigest));
+  if (content) {
+    digestContent(content, 1);
+  }
+}
+
+/*
+ * Digest everything in an inherited style except its position, which is
+ * applied when a recording is replayed. The numbers from the size onwards are
+ * contiguous.
+ */
+static unsigned long digestStyle(const style *style) {
+  unsigned long hash = hashBytes(FNV_OFFSET, &style->size,
+                                 offsetof(struct style, textAlign) - offsetof(struct style, size));
+  hash = hashBytes(hash, &style->textAlign, sizeof(style->textAlign));
+  hash = hashBytes(hash, &style->stripNewlines, sizeof(style->stripNewlines));
+  return hashString(hash, style->face);
+}
+
+/*
+ * Look up a content subtree that is about to be drawn with a stylesheet node
+ * and an inherited style, and count this occurrence of it. Returns NULL if the
+ * subtree cannot be recorded. Only subtrees of a tree that was neither indexed
+ * nor digested with digestRecord are digested here.
+ */
+subtree *findSubtree(cJSON *content, cJSON *stylesheet, const style *style) {
+  unsigned long contentDigest = style->uri[0] ? UNCACHEABLE : digestContent(content, 0);
+  unsigned long stylesheetDigest = stylesheet ? digestStylesheet(stylesheet, 0) : FNV_OFFSET;
+  if (contentDigest == UNCACHEABLE || stylesheetDigest == UNCACHEABLE) {
+    cache.uncacheable++;
+    return NULL;
+  }
+  unsigned long styleDigest = digestStyle(style);
+
+  if (!cache.buckets) {
+    cache.buckets = calloc(SUBTREE_BUCKETS, sizeof(subtree *));
+    if (!cache.buckets) {
+      fprintf(stderr, "Could not allocate subtree cache.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  subtree **bucket =
+      &cache.buckets[(contentDigest ^ stylesheetDigest * 31 ^ styleDigest * 961) % SUBTREE_BUCKETS];
+  subtree *s = *bucket;
+  while (s && (s->content != contentDigest || s->stylesheet != stylesheetDigest ||
+               s->style != styleDigest)) {
+    s = s->chain;
+  }
+
+  if (!s) {
+    if (cache.count >= SUBTREE_LIMIT) {
+      return NULL;
+    }
+    s = calloc(1, sizeof(subtree));
+    if (!s) {
+      fprintf(stderr, "Could not allocate subtree cache.\n");
+      exit(EXIT_FAILURE);
+    }
+    s->content = contentDigest;
+    s->stylesheet = stylesheetDigest;
+    s->style = styleDigest;
+    s->chain = *bucket;
+    *bucket = s;
+    cache.count++;
+  }
+  s->seen++;
+  s->generation = cache.generation;
+  return s;
+}
+
+/*
+ * Paint the recording of a subtree with its origin at the given position.
+ * Returns zero, without drawing anything, if it has not been recorded yet.
+ */
+int replaySubtree(cairo_t *cr, subtree *s, double x, double y) {
+  if (!s->recording) {
+    return 0;
+  }
+  cairo_save(cr);
+  cairo_translate(cr, x, y);
+  cairo_set_source_surface(cr, s->recording, 0, 0);
+  cairo_paint(cr);
+  cairo_restore(cr);
+  cache.hits++;
+  return 1;
+}
+
+/*
+ * Return a context to draw a subtree into, with its origin at zero, if it
+ * should be recorded now. Subtrees are only recorded the second time they are
+ * seen, since most are never repeated.
+ */
+cairo_t *recordSubtree(subtree *s) {
+  if (s->recording || s->seen < 2 || cache.recordings >= SUBTREE_RECORDING_LIMIT) {
+    return NULL;
+  }
+  cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+  return cr;
+}
+
+void finishSubtree(subtree *s, cairo_t *recording) {
+  s->recording = cairo_surface_reference(cairo_get_target(recording));
+  cairo_destroy(recording);
+  cache.recordings++;
+}
+
+static void freeSubtree(subtree *s) {
+  if (s->recording) {
+    cairo_surface_destroy(s->recording);
+    cache.recordings--;
+  }
+  cache.count--;
+  free(s);
+}
+
+/*
+ * Forget every subtree that has not been seen since the last call. Used
+ * between builds in watch mode, so that the cache only holds what the current
+ * document still uses.
+ */
+void trimSubtrees() {
+  for (int i = 0; cache.buckets && i < SUBTREE_BUCKETS; i++) {
+    subtree **link = &cache.buckets[i];
+    while (*link) {
+      subtree *s = *link;
+      if (s->generation != cache.generation) {
+        *link = s->chain;
+        freeSubtree(s);
+      } else {
+        link = &s->chain;
+      }
+    }
+  }
+  cache.generation++;
+}
+
+/*
+ * Print out how well the subtree cache of the calling thread performed
+ */
+void printSubtreeStats() {
+  fprintf(stdout, "Subtrees: %lu distinct, %lu recorded, %lu replayed, %lu uncacheable\n",
+          cache.count, cache.recordings, cache.hits, cache.uncacheable);
+}
+
+void freeSubtrees() {
+  for (int i = 0; cache.buckets && i < SUBTREE_BUCKETS; i++) {
+    while (cache.buckets[i]) {
+      subtree *s = cache.buckets[i];
+      cache.buckets[i] = s->chain;
+      freeSubtree(s);
+    }
+  }
+  free(cache.buckets);
+  memset(&cache, 0, sizeof(cache));
+  free(record.slots);
+  memset(&record, 0, sizeof(record));
+}
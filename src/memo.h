@@ -0,0 +1,18 @@
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "style.h"
+
+typedef struct subtree subtree;
+
+void digestTrees(cJSON *content, cJSON *stylesheet);
+void digestRecord(cJSON *content);
+subtree *findSubtree(cJSON *content, cJSON *stylesheet, const style *style);
+int replaySubtree(cairo_t *cr, subtree *s, double x, double y);
+cairo_t *recordSubtree(subtree *s);
+void finishSubtree(subtree *s, cairo_t *recording);
+void trimSubtrees();
+void printSubtreeStats();
+void freeSubtrees();
+
+#endif
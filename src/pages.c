@@ -0,0 +1,224 @@
+#include <cairo-pdf.h>
+#include <cjson/cJSON.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "pages.h"
+#include "render.h"
+#include "traverse.h"
+
+/*
+ * State shared between the threads that render segments. The lock protects
+ * `next`.
+ */
+typedef struct pageJob {
+  pthread_mutex_t lock;
+  int next;
+  int count;
+  segment *segments;
+  cJSON *content;
+  cJSON *stylesheet;
+  options *options;
+  unsigned int checksum;
+  int logMode;
+} pageJob;
+
+typedef struct pageWorker {
+  pthread_t thread;
+  lua_State *L;
+  pageJob *job;
+} pageWorker;
+
+/*
+ * Links are lost when a recorded page is replayed, so documents that use them
+ * are always rendered in order.
+ */
+int usesLinks(cJSON *stylesheet) {
+  for (cJSON *node = stylesheet->child; node; node = node->next) {
+    if (node->string && strcmp(node->string, "URI") == 0) {
+      return 1;
+    }
+    if (cJSON_IsObject(node) && usesLinks(node)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Split the children of the root at its top level "pageBreak" elements. Each
+ * element ends the segment before it, so that its styles and images are still
+ * drawn. There is always at least one segment.
+ */
+segment *splitPages(cJSON *content, int *count) {
+  *count = 1;
+  for (cJSON *node = content->child; node; node = node->next) {
+    if (isPageBreak(node)) {
+      (*count)++;
+    }
+  }
+
+  segment *segments = calloc(*count, sizeof(segment));
+  if (!segments) {
+    fprintf(stderr, "Could not allocate page segments.\n");
+    exit(EXIT_FAILURE);
+  }
+  int index = 0;
+  int n = 0;
+  for (cJSON *node = content->child; node; node = node->next, index++) {
+    if (isPageBreak(node)) {
+      segments[n].last = index + 1;
+      segments[++n].first = index + 1;
+    }
+  }
+  segments[n].last = index;
+  return segments;
+}
+
+/*
+ * Draw one segment into a list of recorded pages.
+ */
+void recordSegment(segment *s, cJSON *content, cJSON *stylesheet, lua_State *L,
+                   options *options, int logMode) {
+  cairo_rectangle_t extents = {0, 0, options->pageWidth, options->pageHeight};
+  cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  cairo_t *cr = cairo_create(surface);
+
+  setPageFlow(options);
+  recordPages(cr, &s->pages);
+  traverse_range(cr, content, stylesheet, L, logMode, s->first, s->last);
+  finishPages(cr);
+
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+}
+
+/*
+ * Paint recorded pages into the output, starting a new page before each one
+ * except the very first. The last page is left open. The output may itself be
+ * recording pages.
+ */
+void replayPages(cairo_t *cr, pageList *pages, int *first) {
+  for (int j = 0; j < pages->count; j++) {
+    if (!*first) {
+      showPage(cr);
+    }
+    *first = 0;
+    cairo_set_source(cr, pages->pages[j]);
+    cairo_paint(cr);
+  }
+}
+
+/*
+ * Render segments into recording surfaces until there are none left.
+ */
+static void *renderSegments(void *arg) {
+  pageWorker *w = arg;
+  pageJob *job = w->job;
+
+  setContentChecksum(job->checksum);
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    int i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->count) {
+      break;
+    }
+
+    recordSegment(&job->segments[i], job->content, job->stylesheet, w->L, job->options,
+                  job->logMode);
+  }
+  freeRenderCaches();
+  return NULL;
+}
+
+/*
+ * Split the document at its top level "pageBreak" elements and render each
+ * piece on its own thread into recording surfaces, then replay the recorded
+ * pages in order into the output. The last page is left open, as it would be
+ * after a serial traversal. Returns -1 without drawing anything if the
+ * document cannot be split, in which case it must be rendered in order.
+ */
+int renderPages(cairo_t *cr, cJSON *content, cJSON *stylesheet,
+                options *options, int jobs, int logMode) {
+  if (!cJSON_IsObject(content) || usesLinks(stylesheet)) {
+    return -1;
+  }
+
+  /*
+   * Find the segments
+   */
+  int count;
+  segment *segments = splitPages(content, &count);
+  if (count < 2) {
+    free(segments);
+    return -1;
+  }
+
+  /*
+   * Set up the workers, each with its own Lua state
+   */
+  if (jobs > count) {
+    jobs = count;
+  }
+  if (logMode == LOG_VERBOSE) {
+    fprintf(stdout, "Rendering %d page segments on %d threads.\n", count, jobs);
+  }
+
+  pageJob job = {0};
+  pthread_mutex_init(&job.lock, NULL);
+  job.count = count;
+  job.segments = segments;
+  job.content = content;
+  job.stylesheet = stylesheet;
+  job.options = options;
+  job.checksum = getContentChecksum();
+  job.logMode = logMode;
+
+  pageWorker *workers = calloc(jobs, sizeof(pageWorker));
+  if (!workers) {
+    fprintf(stderr, "Could not allocate workers.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < jobs; i++) {
+    workers[i].job = &job;
+    workers[i].L = newLuaState();
+    collectConstants(stylesheet, workers[i].L);
+  }
+
+  int started = 0;
+  for (; started < jobs; started++) {
+    if (pthread_create(&workers[started].thread, NULL, renderSegments, &workers[started])) {
+      break;
+    }
+  }
+  if (!started) {
+    renderSegments(&workers[0]);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  /*
+   * Replay the pages in order
+   */
+  int first = 1;
+  for (int i = 0; i < count; i++) {
+    replayPages(cr, &segments[i].pages, &first);
+    freePages(&segments[i].pages);
+  }
+
+  for (int i = 0; i < jobs; i++) {
+    lua_close(workers[i].L);
+  }
+  free(workers);
+  free(segments);
+  pthread_mutex_destroy(&job.lock);
+
+  return 0;
+}
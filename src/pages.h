@@ -0,0 +1,26 @@
+#ifndef PAGES_H
+#define PAGES_H
+
+#include "render.h"
+
+struct options;
+
+/*
+ * A run of the root's children up to and including a top level "pageBreak"
+ * element, or up to the end, and the pages that it produced.
+ */
+typedef struct segment {
+  int first;
+  int last;
+  pageList pages;
+} segment;
+
+int usesLinks(cJSON *stylesheet);
+segment *splitPages(cJSON *content, int *count);
+void recordSegment(segment *s, cJSON *content, cJSON *stylesheet, lua_State *L,
+                   struct options *options, int logMode);
+void replayPages(cairo_t *cr, pageList *pages, int *first);
+int renderPages(cairo_t *cr, cJSON *content, cJSON *stylesheet,
+                struct options *options, int jobs, int logMode);
+
+#endif
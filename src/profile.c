@@ -0,0 +1,488 @@
+#include <cjson/cJSON.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsml2.h"
+#include "profile.h"
+
+#define PROFILE_BUCKETS 1024
+#define PROFILE_DEPTH 256
+
+static const char *phaseNames[PHASE_COUNT] = {
+    "parse", "index", "fetch", "constants", "styles", "render", "layout", "draw", "images",
+    "raster", "write",
+};
+
+static const char *counterNames[COUNTER_COUNT] = {
+    "evaluations", "finds", "layouts", "nodes",
+};
+
+/*
+ * The time spent in every node with a given path of keys from the root, which
+ * is also its path in the stylesheet. Inclusive time counts the node's
+ * children, exclusive time does not.
+ */
+typedef struct nodeTiming {
+  char *path;
+  unsigned long calls;
+  double inclusive;
+  double exclusive;
+  struct nodeTiming *next;
+} nodeTiming;
+
+/*
+ * A span of time for the trace. Asynchronous spans, such as downloads, may
+ * overlap others on the same thread, and are numbered so that their ends can
+ * be matched up.
+ */
+typedef struct traceEvent {
+  char *name;
+  char *detail;
+  double start;
+  double duration;
+  int thread;
+  unsigned long id;
+} traceEvent;
+
+/*
+ * A node that is being traversed.
+ */
+typedef struct frame {
+  size_t pathLength;
+  double start;
+  double children;
+} frame;
+
+/*
+ * Everything measured by one thread. Each rendering thread measures into its
+ * own, and adds it to the totals when it is finished.
+ */
+typedef struct threadProfile {
+  double phaseStart[PHASE_COUNT];
+  double phaseTime[PHASE_COUNT];
+  unsigned long phaseCalls[PHASE_COUNT];
+  unsigned long counts[COUNTER_COUNT];
+  nodeTiming **nodes;
+  char path[4096];
+  size_t pathLength;
+  frame frames[PROFILE_DEPTH];
+  int depth;
+  traceEvent *events;
+  size_t eventCount;
+  size_t eventSize;
+  int thread;
+} threadProfile;
+
+int profiling;
+static char *reportPath;
+static char *tracePath;
+static double origin;
+static int threads;
+static unsigned long asyncSpans;
+static _Thread_local threadProfile local;
+static threadProfile totals;
+static pthread_mutex_t totalsLock = PTHREAD_MUTEX_INITIALIZER;
+
+double profileClock() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static char *duplicate(const char *s) {
+  char *copy = s ? strdup(s) : NULL;
+  if (s && !copy) {
+    fprintf(stderr, "Could not allocate trace.\n");
+    exit(EXIT_FAILURE);
+  }
+  return copy;
+}
+
+static void startProfiling() {
+  if (!profiling) {
+    origin = profileClock();
+    profiling = 1;
+  }
+}
+
+/*
+ * Start profiling. A report is written to the given path when the program
+ * finishes.
+ */
+void enableProfile(const char *path) {
+  reportPath = duplicate(path);
+  startProfiling();
+}
+
+/*
+ * Start tracing. A trace of every phase, node, expression evaluation and
+ * download is written to the given path when the program finishes.
+ */
+void enableTrace(const char *path) {
+  tracePath = duplicate(path);
+  startProfiling();
+}
+
+static traceEvent *addEvent(const char *name, const char *detail, double start) {
+  if (!local.thread) {
+    pthread_mutex_lock(&totalsLock);
+    local.thread = ++threads;
+    pthread_mutex_unlock(&totalsLock);
+  }
+  if (local.eventCount == local.eventSize) {
+    local.eventSize = local.eventSize ? local.eventSize * 2 : 1024;
+    local.events = realloc(local.events, local.eventSize * sizeof(traceEvent));
+    if (!local.events) {
+      fprintf(stderr, "Could not allocate trace.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  traceEvent *event = &local.events[local.eventCount++];
+  event->name = duplicate(name);
+  event->detail = duplicate(detail);
+  event->start = start;
+  event->duration = profileClock() - start;
+  event->thread = local.thread;
+  event->id = 0;
+  return event;
+}
+
+/*
+ * Add a span that started at the given time and ends now to the trace. Spans
+ * on the same thread must nest.
+ */
+void traceSpan(const char *name, const char *detail, double start) {
+  if (tracePath) {
+    addEvent(name, detail, start);
+  }
+}
+
+/*
+ * Add a span that may overlap others on the same thread to the trace.
+ */
+void traceAsync(const char *name, const char *detail, double start) {
+  if (tracePath) {
+    traceEvent *event = addEvent(name, detail, start);
+    pthread_mutex_lock(&totalsLock);
+    event->id = ++asyncSpans;
+    pthread_mutex_unlock(&totalsLock);
+  }
+}
+
+void beginPhase(enum profilePhase phase) {
+  if (profiling) {
+    local.phaseStart[phase] = profileClock();
+  }
+}
+
+void endPhase(enum profilePhase phase) {
+  if (profiling) {
+    local.phaseTime[phase] += profileClock() - local.phaseStart[phase];
+    local.phaseCalls[phase]++;
+    traceSpan(phaseNames[phase], NULL, local.phaseStart[phase]);
+  }
+}
+
+void countEvent(enum profileCounter counter) {
+  local.counts[counter]++;
+}
+
+static unsigned long hashPath(const char *s) {
+  unsigned long hash = 14695981039346656037UL;
+  while (*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static nodeTiming *findTiming(nodeTiming ***table, const char *path) {
+  if (!*table) {
+    *table = calloc(PROFILE_BUCKETS, sizeof(nodeTiming *));
+    if (!*table) {
+      fprintf(stderr, "Could not allocate profile.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  nodeTiming **bucket = &(*table)[hashPath(path) % PROFILE_BUCKETS];
+  nodeTiming *timing = *bucket;
+  while (timing && strcmp(timing->path, path) != 0) {
+    timing = timing->next;
+  }
+  if (!timing) {
+    timing = calloc(1, sizeof(nodeTiming));
+    if (!timing || !(timing->path = strdup(path))) {
+      fprintf(stderr, "Could not allocate profile.\n");
+      exit(EXIT_FAILURE);
+    }
+    timing->next = *bucket;
+    *bucket = timing;
+  }
+  return timing;
+}
+
+/*
+ * Start timing a node, whose key is added to the current path. Nodes nested
+ * too deeply to be tracked are counted towards their nearest tracked ancestor.
+ */
+void enterNode(const char *key) {
+  if (local.depth < PROFILE_DEPTH) {
+    frame *f = &local.frames[local.depth];
+    f->pathLength = local.pathLength;
+    size_t remaining = sizeof(local.path) - local.pathLength;
+    int written = snprintf(local.path + local.pathLength, remaining, "/%s", key ? key : "");
+    local.pathLength += (size_t)written < remaining ? (size_t)written : remaining - 1;
+    f->children = 0;
+    f->start = profileClock();
+  }
+  local.depth++;
+  local.counts[COUNT_NODES]++;
+}
+
+void leaveNode() {
+  local.depth--;
+  if (local.depth >= PROFILE_DEPTH) {
+    return;
+  }
+  frame *f = &local.frames[local.depth];
+  double elapsed = profileClock() - f->start;
+  traceSpan(local.path, NULL, f->start);
+
+  nodeTiming *timing = findTiming(&local.nodes, local.path);
+  timing->calls++;
+  timing->inclusive += elapsed;
+  timing->exclusive += elapsed - f->children;
+  if (local.depth > 0) {
+    local.frames[local.depth - 1].children += elapsed;
+  }
+
+  local.pathLength = f->pathLength;
+  local.path[local.pathLength] = 0;
+}
+
+/*
+ * Add everything measured by the calling thread to the totals. Must be called
+ * by every thread that renders before it exits.
+ */
+void flushProfile() {
+  if (!profiling) {
+    return;
+  }
+  pthread_mutex_lock(&totalsLock);
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    totals.phaseTime[i] += local.phaseTime[i];
+    totals.phaseCalls[i] += local.phaseCalls[i];
+  }
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    totals.counts[i] += local.counts[i];
+  }
+  for (int i = 0; local.nodes && i < PROFILE_BUCKETS; i++) {
+    while (local.nodes[i]) {
+      nodeTiming *timing = local.nodes[i];
+      nodeTiming *total = findTiming(&totals.nodes, timing->path);
+      total->calls += timing->calls;
+      total->inclusive += timing->inclusive;
+      total->exclusive += timing->exclusive;
+      local.nodes[i] = timing->next;
+      free(timing->path);
+      free(timing);
+    }
+  }
+  for (size_t i = 0; i < local.eventCount; i++) {
+    if (totals.eventCount == totals.eventSize) {
+      totals.eventSize = totals.eventSize ? totals.eventSize * 2 : 1024;
+      totals.events = realloc(totals.events, totals.eventSize * sizeof(traceEvent));
+      if (!totals.events) {
+        fprintf(stderr, "Could not allocate trace.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    totals.events[totals.eventCount++] = local.events[i];
+  }
+  pthread_mutex_unlock(&totalsLock);
+
+  free(local.events);
+  free(local.nodes);
+  memset(&local, 0, sizeof(local));
+}
+
+static int slowerThan(const void *a, const void *b) {
+  const nodeTiming *x = *(const nodeTiming **)a;
+  const nodeTiming *y = *(const nodeTiming **)b;
+  return (x->exclusive < y->exclusive) - (x->exclusive > y->exclusive);
+}
+
+/*
+ * Write the report: the time spent in each phase, the counters, and the nodes
+ * with the most exclusive time. Phases that run on several threads at once
+ * report the sum of their times.
+ */
+static void writeReport() {
+  cJSON *report = cJSON_CreateObject();
+  cJSON *phases = cJSON_AddObjectToObject(report, "phases");
+  for (int i = 0; i < PHASE_COUNT; i++) {
+    cJSON *phase = cJSON_AddObjectToObject(phases, phaseNames[i]);
+    cJSON_AddNumberToObject(phase, "seconds", totals.phaseTime[i]);
+    cJSON_AddNumberToObject(phase, "calls", totals.phaseCalls[i]);
+  }
+  cJSON *counters = cJSON_AddObjectToObject(report, "counters");
+  for (int i = 0; i < COUNTER_COUNT; i++) {
+    cJSON_AddNumberToObject(counters, counterNames[i], totals.counts[i]);
+  }
+
+  size_t count = 0;
+  for (int i = 0; totals.nodes && i < PROFILE_BUCKETS; i++) {
+    for (nodeTiming *timing = totals.nodes[i]; timing; timing = timing->next) {
+      count++;
+    }
+  }
+  nodeTiming **sorted = calloc(count ? count : 1, sizeof(nodeTiming *));
+  if (!sorted) {
+    fprintf(stderr, "Could not allocate profile.\n");
+    exit(EXIT_FAILURE);
+  }
+  count = 0;
+  for (int i = 0; totals.nodes && i < PROFILE_BUCKETS; i++) {
+    for (nodeTiming *timing = totals.nodes[i]; timing; timing = timing->next) {
+      sorted[count++] = timing;
+    }
+  }
+  qsort(sorted, count, sizeof(nodeTiming *), slowerThan);
+
+  cJSON *nodes = cJSON_AddArrayToObject(report, "slowestNodes");
+  for (size_t i = 0; i < count && i < PROFILE_SLOWEST_NODES; i++) {
+    cJSON *node = cJSON_CreateObject();
+    cJSON_AddStringToObject(node, "path", sorted[i]->path);
+    cJSON_AddNumberToObject(node, "calls", sorted[i]->calls);
+    cJSON_AddNumberToObject(node, "inclusive", sorted[i]->inclusive);
+    cJSON_AddNumberToObject(node, "exclusive", sorted[i]->exclusive);
+    cJSON_AddItemToArray(nodes, node);
+  }
+  free(sorted);
+
+  char *printed = cJSON_Print(report);
+  FILE *f = strcmp(reportPath, "-") == 0 ? stdout : fopen(reportPath, "w");
+  if (!f || !printed) {
+    fprintf(stderr, "Could not write profile to \"%s\".\n", reportPath);
+  } else {
+    fprintf(f, "%s\n", printed);
+    if (f != stdout) {
+      fclose(f);
+    }
+  }
+  cJSON_free(printed);
+  cJSON_Delete(report);
+}
+
+/*
+ * Write a string as a quoted JSON string.
+ */
+static void writeString(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      fprintf(f, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(f, "\\u%04x", c);
+    } else {
+      fputc(c, f);
+    }
+  }
+  fputc('"', f);
+}
+
+static void writeEvent(FILE *f, const traceEvent *event, char type, double time) {
+  fprintf(f, "{\"name\":");
+  writeString(f, event->name);
+  fprintf(f, ",\"cat\":\"dsml2\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", type,
+          (time - origin) * 1e6, event->thread);
+  if (type == 'X') {
+    fprintf(f, ",\"dur\":%.3f", event->duration * 1e6);
+  } else {
+    fprintf(f, ",\"id\":%lu", event->id);
+  }
+  if (event->detail) {
+    fprintf(f, ",\"args\":{\"detail\":");
+    writeString(f, event->detail);
+    fprintf(f, "}");
+  }
+  fprintf(f, "}");
+}
+
+/*
+ * Write the trace in the trace event format, which chrome://tracing and
+ * Perfetto load. Nested spans are complete events; asynchronous spans are
+ * written as a begin and end pair. The thread that started first is the main
+ * thread.
+ */
+static void writeTrace() {
+  FILE *f = strcmp(tracePath, "-") == 0 ? stdout : fopen(tracePath, "w");
+  if (!f) {
+    fprintf(stderr, "Could not write trace to \"%s\".\n", tracePath);
+    return;
+  }
+
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (int i = 1; i <= threads; i++) {
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+               "\"args\":{\"name\":\"%s %d\"}},\n",
+            i, i == 1 ? "main" : "render", i);
+  }
+  for (size_t i = 0; i < totals.eventCount; i++) {
+    const traceEvent *event = &totals.events[i];
+    if (event->id) {
+      writeEvent(f, event, 'b', event->start);
+      fprintf(f, ",\n");
+      writeEvent(f, event, 'e', event->start + event->duration);
+    } else {
+      writeEvent(f, event, 'X', event->start);
+    }
+    fprintf(f, i + 1 < totals.eventCount ? ",\n" : "\n");
+  }
+  fprintf(f, "]}\n");
+  if (f != stdout) {
+    fclose(f);
+  }
+}
+
+/*
+ * Write out the report and the trace, whichever were asked for, and stop
+ * profiling.
+ */
+void writeProfile() {
+  if (!profiling) {
+    return;
+  }
+  flushProfile();
+  if (reportPath) {
+    writeReport();
+  }
+  if (tracePath) {
+    writeTrace();
+  }
+
+  for (int i = 0; totals.nodes && i < PROFILE_BUCKETS; i++) {
+    while (totals.nodes[i]) {
+      nodeTiming *next = totals.nodes[i]->next;
+      free(totals.nodes[i]->path);
+      free(totals.nodes[i]);
+      totals.nodes[i] = next;
+    }
+  }
+  free(totals.nodes);
+  for (size_t i = 0; i < totals.eventCount; i++) {
+    free(totals.events[i].name);
+    free(totals.events[i].detail);
+  }
+  free(totals.events);
+  memset(&totals, 0, sizeof(totals));
+  free(reportPath);
+  free(tracePath);
+  reportPath = NULL;
+  tracePath = NULL;
+  profiling = 0;
+}
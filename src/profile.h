@@ -0,0 +1,51 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+ * The phases that a run is broken down into. Phases may be nested: layout,
+ * drawing, images and writing happen during rendering, and their time is also
+ * counted towards it. Raster output is rasterized after rendering.
+ */
+enum profilePhase {
+  PHASE_PARSE,
+  PHASE_INDEX,
+  PHASE_FETCH,
+  PHASE_CONSTANTS,
+  PHASE_STYLES,
+  PHASE_RENDER,
+  PHASE_LAYOUT,
+  PHASE_DRAW,
+  PHASE_IMAGES,
+  PHASE_RASTER,
+  PHASE_WRITE,
+  PHASE_COUNT,
+};
+
+enum profileCounter {
+  COUNT_EVALUATIONS,
+  COUNT_FINDS,
+  COUNT_LAYOUTS,
+  COUNT_NODES,
+  COUNTER_COUNT,
+};
+
+/*
+ * Non-zero when profiling or tracing. Hot paths test this before calling into
+ * the profiler, so that it costs nothing otherwise.
+ */
+extern int profiling;
+
+void enableProfile(const char *path);
+void enableTrace(const char *path);
+double profileClock();
+void traceSpan(const char *name, const char *detail, double start);
+void traceAsync(const char *name, const char *detail, double start);
+void beginPhase(enum profilePhase phase);
+void endPhase(enum profilePhase phase);
+void countEvent(enum profileCounter counter);
+void enterNode(const char *key);
+void leaveNode();
+void flushProfile();
+void writeProfile();
+
+#endif
@@ -0,0 +1,218 @@
+#include <cairo.h>
+#include <cjson/cJSON.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dsml2.h"
+#include "lua.h"
+#include "pages.h"
+#include "profile.h"
+#include "raster.h"
+#include "render.h"
+#include "traverse.h"
+
+/*
+ * A page that is being rasterized. The image is split into horizontal bands,
+ * each of which is drawn straight into its rows of the image by its own
+ * thread, so the tiles never need to be copied together. The lock protects
+ * `next`.
+ */
+typedef struct rasterJob {
+  pthread_mutex_t lock;
+  int next;
+  int tiles;
+  cairo_pattern_t *page;
+  unsigned char *data;
+  int width;
+  int height;
+  int stride;
+  double scale;
+} rasterJob;
+
+typedef struct rasterWorker {
+  pthread_t thread;
+  rasterJob *job;
+} rasterWorker;
+
+/*
+ * Replaying a recording writes scratch state into it, and into every
+ * recording drawn from it, such as icons and memoized subtrees, which pages
+ * share. Recordings cannot be replayed by two threads at once, so replaying
+ * is done with this lock held.
+ */
+static pthread_mutex_t replayLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Draw one band of a page on a white background.
+ */
+static void rasterizeTile(rasterJob *job, int i) {
+  beginPhase(PHASE_RASTER);
+  int top = (long)job->height * i / job->tiles;
+  int bottom = (long)job->height * (i + 1) / job->tiles;
+  cairo_surface_t *tile = cairo_image_surface_create_for_data(
+      job->data + (size_t)top * job->stride, CAIRO_FORMAT_RGB24, job->width, bottom - top,
+      job->stride);
+  cairo_t *cr = cairo_create(tile);
+  cairo_set_source_rgb(cr, 1, 1, 1);
+  cairo_paint(cr);
+  cairo_translate(cr, 0, -top);
+  cairo_scale(cr, job->scale, job->scale);
+  cairo_set_source(cr, job->page);
+  pthread_mutex_lock(&replayLock);
+  cairo_paint(cr);
+  pthread_mutex_unlock(&replayLock);
+  cairo_destroy(cr);
+  cairo_surface_destroy(tile);
+  endPhase(PHASE_RASTER);
+}
+
+/*
+ * Rasterize tiles until there are none left.
+ */
+static void *rasterizeTiles(void *arg) {
+  rasterWorker *w = arg;
+  rasterJob *job = w->job;
+
+  while (1) {
+    pthread_mutex_lock(&job->lock);
+    int i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->tiles) {
+      break;
+    }
+    rasterizeTile(job, i);
+  }
+  flushProfile();
+  return NULL;
+}
+
+/*
+ * Rasterize a recorded page into an image, one tile per thread.
+ */
+static void rasterizePage(cairo_surface_t *image, cairo_pattern_t *page, double scale,
+                          int tiles) {
+  rasterJob job = {0};
+  pthread_mutex_init(&job.lock, NULL);
+  cairo_surface_flush(image);
+  job.page = page;
+  job.data = cairo_image_surface_get_data(image);
+  job.width = cairo_image_surface_get_width(image);
+  job.height = cairo_image_surface_get_height(image);
+  job.stride = cairo_image_surface_get_stride(image);
+  job.scale = scale;
+  job.tiles = tiles < job.height ? tiles : job.height;
+
+  int count = job.tiles;
+  rasterWorker *workers = calloc(count, sizeof(rasterWorker));
+  if (!workers) {
+    fprintf(stderr, "Could not allocate workers.\n");
+    exit(EXIT_FAILURE);
+  }
+  int started = 0;
+  for (; started < count; started++) {
+    workers[started].job = &job;
+    if (pthread_create(&workers[started].thread, NULL, rasterizeTiles, &workers[started])) {
+      break;
+    }
+  }
+  if (!started) {
+    workers[0].job = &job;
+    rasterizeTiles(&workers[0]);
+  }
+  for (int i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+
+  cairo_surface_mark_dirty(image);
+  free(workers);
+  pthread_mutex_destroy(&job.lock);
+}
+
+/*
+ * Work out the file that a page is written to. "%p" in the output filename is
+ * replaced with the page number. Otherwise the first page is written to the
+ * filename as given, and each later page to the filename with "-" and the page
+ * number inserted before its extension. Returns -1 if the result does not fit.
+ */
+static int pageFilename(char *out, size_t size, const char *filename, int page) {
+  const char *marker = strstr(filename, "%p");
+  int written;
+  if (marker) {
+    written = snprintf(out, size, "%.*s%d%s", (int)(marker - filename), filename, page,
+                       marker + 2);
+  } else if (page == 1) {
+    written = snprintf(out, size, "%s", filename);
+  } else {
+    const char *slash = strrchr(filename, '/');
+    const char *extension = strrchr(filename, '.');
+    if (!extension || (slash && extension < slash)) {
+      extension = filename + strlen(filename);
+    }
+    written = snprintf(out, size, "%.*s-%d%s", (int)(extension - filename), filename, page,
+                       extension);
+  }
+  return written < 0 || (size_t)written >= size ? -1 : 0;
+}
+
+/*
+ * Render a complete document to one PNG file per page, at a resolution in dots
+ * per inch. The pages are recorded first, in parallel if allowed as for PDF
+ * output, and each is then rasterized in tiles on their own threads. Returns
+ * zero on success, or -1 if a file could not be written.
+ */
+int renderRaster(const char *filename, cJSON *content, cJSON *stylesheet, lua_State *L,
+                 options *options, double dpi, int tiles, int jobs, int logMode) {
+  double scale = dpi / POINTS_PER_INCH;
+  int width = options->pageWidth * scale + 0.5;
+  int height = options->pageHeight * scale + 0.5;
+  cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+  if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+    fprintf(stderr, "Could not allocate a %dx%d image.\n", width, height);
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Record every page
+   */
+  cairo_rectangle_t extents = {0, 0, options->pageWidth, options->pageHeight};
+  cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  cairo_t *cr = cairo_create(surface);
+  pageList pages = {0};
+  beginPhase(PHASE_RENDER);
+  setPageFlow(options);
+  recordPages(cr, &pages);
+  if (jobs < 2 || renderPages(cr, content, stylesheet, options, jobs, logMode)) {
+    simultaneous_traversal(cr, content, stylesheet, L, logMode);
+  }
+  finishPages(cr);
+  endPhase(PHASE_RENDER);
+  if (logMode == LOG_VERBOSE) {
+    fprintf(stdout, "Rasterizing %d pages at %dx%d in %d tiles.\n", pages.count, width, height,
+            tiles);
+  }
+
+  /*
+   * Rasterize and write out each page in turn, reusing the same image
+   */
+  int status = 0;
+  for (int i = 0; i < pages.count && status == 0; i++) {
+    char name[4096];
+    rasterizePage(image, pages.pages[i], scale, tiles);
+    beginPhase(PHASE_WRITE);
+    if (pageFilename(name, sizeof(name), filename, i + 1) ||
+        cairo_surface_write_to_png(image, name) != CAIRO_STATUS_SUCCESS) {
+      status = -1;
+    }
+    endPhase(PHASE_WRITE);
+  }
+
+  freePages(&pages);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+  cairo_surface_destroy(image);
+  return status;
+}
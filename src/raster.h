@@ -0,0 +1,9 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+struct options;
+
+int renderRaster(const char *filename, cJSON *content, cJSON *stylesheet, lua_State *L,
+                 struct options *options, double dpi, int tiles, int jobs, int logMode);
+
+#endif
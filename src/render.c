@@ -1,18 +1,27 @@
 #include <cjson/cJSON.h>
-#include <curl/curl.h>
-#include <librsvg-2.0/librsvg/rsvg.h>
+#include <lauxlib.h>
 #include <pango/pangocairo.h>
 
+#include "image.h"
+#include "include.h"
+#include "lua.h"
+#include "memo.h"
+#include "profile.h"
+#include "render.h"
+#include "shape.h"
 #include "style.h"
 #include "traverse.h"
 #include "version.h"
 
 /*
- * Various checksums and their `set` functions.
+ * Various checksums and their `set` functions. The content checksum is per
+ * thread, since batch mode renders several documents at once.
  */
-unsigned int contentChecksum;
+_Thread_local unsigned int contentChecksum;
 unsigned int stylesheetChecksum;
 
+int draft;
+
 void setContentChecksum(unsigned int checksum) {
   contentChecksum = checksum;
 }
@@ -21,11 +30,226 @@ void setStylesheetChecksum(unsigned int checksum) {
   stylesheetChecksum = checksum;
 }
 
+unsigned int getContentChecksum() {
+  return contentChecksum;
+}
+
+/*
+ * When pages are being recorded rather than written straight to the output,
+ * this is the list that finished pages are added to.
+ */
+static _Thread_local pageList *recorder;
+
+static void addPage(pageList *pages, cairo_pattern_t *page) {
+  if (pages->count == pages->size) {
+    pages->size = pages->size ? pages->size * 2 : 4;
+    pages->pages = realloc(pages->pages, pages->size * sizeof(cairo_pattern_t *));
+    if (!pages->pages) {
+      fprintf(stderr, "Could not allocate page list.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pages->pages[pages->count++] = page;
+}
+
 /*
- * The callback that cURL uses to write the icon file to the filesystem.
+ * Start recording everything drawn to a context into a list of pages, instead
+ * of drawing it directly.
  */
-size_t writeCallback(void *ptr, size_t size, size_t nmemb, FILE *stream) {
-  return fwrite(ptr, size, nmemb, stream);
+void recordPages(cairo_t *cr, pageList *pages) {
+  recorder = pages;
+  cairo_push_group(cr);
+}
+
+/*
+ * Stop recording pages, adding the page in progress to the list.
+ */
+void finishPages(cairo_t *cr) {
+  addPage(recorder, cairo_pop_group(cr));
+  recorder = NULL;
+}
+
+void freePages(pageList *pages) {
+  for (int i = 0; i < pages->count; i++) {
+    cairo_pattern_destroy(pages->pages[i]);
+  }
+  free(pages->pages);
+  pages->pages = NULL;
+  pages->count = 0;
+  pages->size = 0;
+}
+
+/*
+ * End the current page, either by emitting it or by adding it to the list of
+ * recorded pages.
+ */
+void showPage(cairo_t *cr) {
+  if (recorder) {
+    addPage(recorder, cairo_pop_group(cr));
+    cairo_push_group(cr);
+  } else {
+    beginPhase(PHASE_WRITE);
+    cairo_show_page(cr);
+    endPhase(PHASE_WRITE);
+  }
+}
+
+/*
+ * In flow mode, the band of the page that text is laid into: text that would
+ * end below `bottom` continues from `top` on the next page. Set by each
+ * rendering thread before it draws.
+ */
+typedef struct pageFlow {
+  int enabled;
+  float top;
+  float bottom;
+} pageFlow;
+
+static _Thread_local pageFlow flow;
+
+void setPageFlow(const options *options) {
+  flow.enabled = options->flow != 0;
+  flow.top = options->pageMargin;
+  flow.bottom = options->pageHeight - options->pageMargin;
+}
+
+/*
+ * Whether text may start new pages by itself. Such text cannot be drawn into a
+ * recording that is replayed on a single page.
+ */
+int isFlowing() {
+  return flow.enabled;
+}
+
+/*
+ * A "pageBreak" element that is drawn without breaking the page, since the
+ * break is made by whoever assembles the pages. Set by each rendering thread.
+ */
+static _Thread_local cJSON *heldBreak;
+
+/*
+ * How many "pageBreak" elements the calling thread has drawn, held or not.
+ * Text that flowed onto new pages only moves what follows it up to the next
+ * break, which starts a fresh page.
+ */
+static _Thread_local unsigned long pageBreaks;
+
+void holdPageBreak(cJSON *content) {
+  heldBreak = content;
+}
+
+unsigned long getPageBreaks() {
+  return pageBreaks;
+}
+
+/*
+ * Whether a content node is a "pageBreak" element.
+ */
+int isPageBreak(cJSON *content) {
+  return cJSON_IsString(content) && content->valuestring && content->string &&
+         strcmp(content->valuestring, "CURRENT_DATE") != 0 &&
+         strncmp(content->string, "pageBreak", strlen("pageBreak")) == 0;
+}
+
+/*
+ * Pango objects that are reused from one text node to the next: a context, a
+ * single layout, and font descriptions keyed by face and size. Each rendering
+ * thread has its own.
+ */
+typedef struct textCache {
+  PangoContext *context;
+  PangoLayout *layout;
+  GHashTable *fonts;
+  unsigned long fontHits;
+  unsigned long fontMisses;
+  unsigned long layoutsReused;
+} textCache;
+
+static _Thread_local textCache text;
+
+/*
+ * Return the font description for a face and size, creating it if this is the
+ * first time that combination has been used.
+ */
+static PangoFontDescription *getFont(const char *face, float size) {
+  char key[300];
+  snprintf(key, sizeof(key), "%s@%g", face, size);
+
+  if (!text.fonts) {
+    text.fonts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       (GDestroyNotify)pango_font_description_free);
+  }
+  PangoFontDescription *font_description = g_hash_table_lookup(text.fonts, key);
+  if (font_description) {
+    text.fontHits++;
+    return font_description;
+  }
+  text.fontMisses++;
+
+  font_description = pango_font_description_new();
+  pango_font_description_set_family(font_description, face);
+  pango_font_description_set_absolute_size(font_description, size * PANGO_SCALE);
+  g_hash_table_insert(text.fonts, g_strdup(key), font_description);
+  return font_description;
+}
+
+/*
+ * Return the shared layout, brought up to date with the target and
+ * transformation of the given context.
+ */
+static PangoLayout *getLayout(cairo_t *cr) {
+  if (!text.context) {
+    text.context = pango_cairo_create_context(cr);
+    if (draft) {
+      cairo_font_options_t *fontOptions = cairo_font_options_create();
+      cairo_font_options_set_hint_style(fontOptions, CAIRO_HINT_STYLE_NONE);
+      cairo_font_options_set_hint_metrics(fontOptions, CAIRO_HINT_METRICS_OFF);
+      cairo_font_options_set_antialias(fontOptions, CAIRO_ANTIALIAS_FAST);
+      pango_cairo_context_set_font_options(text.context, fontOptions);
+      cairo_font_options_destroy(fontOptions);
+    }
+    text.layout = pango_layout_new(text.context);
+  } else {
+    text.layoutsReused++;
+  }
+  pango_cairo_update_layout(cr, text.layout);
+  return text.layout;
+}
+
+/*
+ * Print out how well the text cache of the calling thread performed
+ */
+void printTextStats() {
+  unsigned long total = text.fontHits + text.fontMisses;
+  fprintf(stdout, "Fonts: %lu lookups, %lu created (%.1f%% hit rate)\n",
+          total, text.fontMisses, total ? 100. * text.fontHits / total : 0.);
+  fprintf(stdout, "Layouts: %d created, %lu reused\n",
+          text.layout ? 1 : 0, text.layoutsReused);
+  printShapeStats();
+  printSubtreeStats();
+  printIncludeStats();
+}
+
+/*
+ * Release everything cached by the calling thread. Must be called by every
+ * thread that renders before it exits.
+ */
+void freeRenderCaches() {
+  if (text.fonts) {
+    g_hash_table_destroy(text.fonts);
+  }
+  if (text.layout) {
+    g_object_unref(text.layout);
+  }
+  if (text.context) {
+    g_object_unref(text.context);
+  }
+  memset(&text, 0, sizeof(text));
+  freeShapeCache();
+  freeSubtrees();
+  freeIncludes();
+  freeIcons();
+  flushProfile();
 }
 
 void handleImages(cairo_t *cr, cJSON *stylesheet, style *style) {
@@ -50,11 +274,15 @@ void handleImages(cairo_t *cr, cJSON *stylesheet, style *style) {
       cairo_scale(cr, style->size, style->size);
 
       /*
-       * Display the image
+       * Display the image, decoding it only the first time it is used
        */
-      cairo_surface_t *sfc = cairo_image_surface_create_from_png(filename->valuestring);
-      cairo_set_source_surface(cr, sfc, 0, 0);
-      cairo_paint(cr);
+      beginPhase(PHASE_IMAGES);
+      if (draft) {
+        paintImagePlaceholder(cr, filename->valuestring);
+      } else {
+        paintImage(cr, filename->valuestring);
+      }
+      endPhase(PHASE_IMAGES);
 
       /*
        * Restore the graphics context
@@ -84,40 +312,17 @@ void handleImages(cairo_t *cr, cJSON *stylesheet, style *style) {
       cairo_translate(cr, style->x, style->y);
 
       /*
-       * Try to open the image, download it from the internet if that doesn't
-       * succeed
+       * Draw the image. Missing icons have already been downloaded by
+       * prefetchIcons, so anything that cannot be opened now is an error.
        */
-      RsvgHandle *rsvg = rsvg_handle_new_from_file(n->valuestring, 0);
-      if (!rsvg) {
-        fprintf(stderr, "File was not found locally, downloading.\n");
-        CURL *handle = curl_easy_init();
-        if (handle) {
-          FILE *f = fopen(n->valuestring, "wb");
-          curl_easy_setopt(handle, CURLOPT_URL, u->valuestring);
-          curl_easy_setopt(handle, CURLOPT_WRITEDATA, f);
-          curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeCallback);
-          curl_easy_perform(handle);
-          curl_easy_cleanup(handle);
-          fclose(f);
-        } else {
-          fprintf(stderr, "cURL failure.\n");
-          exit(EXIT_FAILURE);
-        }
-        rsvg = rsvg_handle_new_from_file(n->valuestring, 0);
-      }
-
-      /*
-       * Display the image
-       */
-      RsvgRectangle r;
-      r.x = 0;
-      r.y = 0;
-      r.width = style->size;
-      r.height = style->size;
-      if (!rsvg_handle_render_document(rsvg, cr, &r, NULL)) {
-        fprintf(stderr, "Icon could not be rendered.\n");
+      beginPhase(PHASE_IMAGES);
+      if (draft) {
+        paintIconPlaceholder(cr, style->size);
+      } else if (paintIcon(cr, n->valuestring, style->size)) {
+        fprintf(stderr, "Icon \"%s\" could not be loaded.\n", n->valuestring);
         exit(EXIT_FAILURE);
       }
+      endPhase(PHASE_IMAGES);
 
       /*
        * Restore the graphics context
@@ -127,41 +332,103 @@ void handleImages(cairo_t *cr, cJSON *stylesheet, style *style) {
   }
 }
 
-void renderText(cairo_t *cr, cJSON *content, style *style) {
-  if (cJSON_IsString(content) && content->valuestring) {
+/*
+ * Draw the lines of the shared layout that start at or below the height `from`
+ * within it, until one would end below the height `to`, in the same way as
+ * drawShapedLines.
+ */
+static double drawLayoutLines(cairo_t *cr, PangoLayout *layout, double x, double y,
+                              double from, double to, int force) {
+  double next = -1;
+  int drawn = 0;
+  PangoLayoutIter *iter = pango_layout_get_iter(layout);
+  do {
+    int top;
+    int bottom;
+    pango_layout_iter_get_line_yrange(iter, &top, &bottom);
+    if ((double)top / PANGO_SCALE < from) {
+      continue;
+    }
+    if ((double)bottom / PANGO_SCALE > to && !(force && !drawn)) {
+      next = (double)top / PANGO_SCALE;
+      break;
+    }
+    PangoRectangle logical;
+    pango_layout_iter_get_line_extents(iter, NULL, &logical);
+    cairo_move_to(cr, x + (double)logical.x / PANGO_SCALE,
+                  y + (double)pango_layout_iter_get_baseline(iter) / PANGO_SCALE);
+    pango_cairo_show_layout_line(cr, pango_layout_iter_get_line_readonly(iter));
+    drawn = 1;
+  } while (pango_layout_iter_next_line(iter));
+  pango_layout_iter_free(iter);
+  return next;
+}
+
+/*
+ * Draw a paragraph that has been laid out once, breaking it between lines
+ * wherever it reaches the bottom of the page and continuing at the top of the
+ * next. A line taller than the whole band is drawn on a page of its own.
+ * Returns how far everything drawn after the paragraph has to move to follow
+ * it onto the page where it ended, or zero if it did not break.
+ */
+static float flowText(cairo_t *cr, const shapedText *shaped, PangoLayout *layout,
+                      const style *style) {
+  double from = 0;
+  double y = style->y;
+  while (1) {
+    double to = from + flow.bottom - y;
+    int force = y <= flow.top;
+    double next = shaped ? drawShapedLines(cr, shaped, style->x, y - from, from, to, force)
+                         : drawLayoutLines(cr, layout, style->x, y - from, from, to, force);
+    if (next < 0) {
+      return y - from - style->y;
+    }
 
     /*
-     * Configure the style of text that is to be displayed
+     * Links cannot span pages, so the link is ended and started again. Ending
+     * a recorded page also restores the context, losing the text color.
      */
+    if (!draft) {
+      cairo_tag_end(cr, CAIRO_TAG_LINK);
+    }
+    showPage(cr);
+    if (!draft) {
+      cairo_tag_begin(cr, CAIRO_TAG_LINK, style->uri);
+    }
     cairo_set_source_rgba(cr, style->r, style->g, style->b, style->a);
-    PangoFontDescription *font_description = pango_font_description_new();
-    pango_font_description_set_family(font_description, style->face);
-    pango_font_description_set_absolute_size(font_description,
-                                             style->size * PANGO_SCALE);
-
-    PangoLayout *layout = pango_cairo_create_layout(cr);
-    pango_layout_set_font_description(layout, font_description);
-
-    pango_layout_set_justify(layout, TRUE);
+    from = next;
+    y = flow.top;
+  }
+}
 
-    pango_layout_set_line_spacing(layout, style->spacing);
+/*
+ * Outline the logical extents of the shared layout in draft mode, one device
+ * unit wide.
+ */
+static void outlineLayout(cairo_t *cr, PangoLayout *layout, double x, double y) {
+  PangoRectangle logical;
+  pango_layout_get_extents(layout, NULL, &logical);
+  cairo_save(cr);
+  cairo_rectangle(cr, x + (double)logical.x / PANGO_SCALE, y + (double)logical.y / PANGO_SCALE,
+                  (double)logical.width / PANGO_SCALE, (double)logical.height / PANGO_SCALE);
+  cairo_identity_matrix(cr);
+  cairo_set_line_width(cr, 1);
+  cairo_set_source_rgba(cr, 1, 0, 0, 0.5);
+  cairo_stroke(cr);
+  cairo_restore(cr);
+}
 
-    if (style->width != 0) {
-      pango_layout_set_width(layout, PANGO_SCALE * style->width);
-    }
-    if (style->textAlign == ALIGN_CENTER) {
-      pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
-      if (style->width == 0) {
-        fprintf(stderr, "Alignment set to 'center', but missing width.\n");
-      }
-      style->x -= style->width / 2.;
-    } else if (style->textAlign == ALIGN_RIGHT) {
-      pango_layout_set_alignment(layout, PANGO_ALIGN_RIGHT);
-      if (style->width == 0) {
-        fprintf(stderr, "Alignment set to 'right', but missing width.\n");
-      }
-      style->x -= style->width;
-    }
+/*
+ * Draw the text of a content node. Returns how far the elements drawn after it
+ * have to move down the page, which is only ever nonzero when the text flowed
+ * onto new pages.
+ */
+float renderText(cairo_t *cr, cJSON *content, style *style) {
+  float shift = 0;
+  if (cJSON_IsString(content) && content->valuestring) {
+    const char *markup;
+    int length = -1;
+    char buf[256];
 
     /*
      * Write out the current date and time.
@@ -169,10 +436,14 @@ void renderText(cairo_t *cr, cJSON *content, style *style) {
     if (strcmp(content->valuestring, "CURRENT_DATE") == 0) {
       time_t now;
       time(&now);
-      pango_layout_set_markup(layout, ctime(&now), -1);
+      markup = ctime_r(&now, buf);
 
     } else if (strncmp(content->string, "pageBreak", strlen("pageBreak")) == 0) {
-      cairo_show_page(cr);
+      if (content != heldBreak) {
+        showPage(cr);
+      }
+      pageBreaks++;
+      return 0;
 
       /*
      * Transclusion directive. The token "INCLUDE:" will indicate that the text
@@ -180,71 +451,109 @@ void renderText(cairo_t *cr, cJSON *content, style *style) {
      * the text of the current element.
      */
     } else if (strncmp(content->valuestring, "INCLUDE:", strlen("INCLUDE:")) == 0) {
-      for (int i = 0; i < strlen(content->valuestring); i++) {
-        if (content->valuestring[i] == ':') {
-          FILE *f = fopen(content->valuestring + i + 1, "rb");
-          if (!f) {
-            fprintf(stderr, "Trying to open \"%s\".\n", content->valuestring + i + 1);
-            perror("fopen");
-            exit(EXIT_FAILURE);
-          }
-
-          fseek(f, 0, SEEK_END);
-          int size = ftell(f);
-          rewind(f);
-
-          /*
-           * Read the file data into memory
-           */
-          char buffer[size + 1];
-          buffer[size] = 0;
-          int ret = fread(buffer, 1, size, f);
-          if (ret != size) {
-            fprintf(stderr, "Could not read the expected number of bytes.\n");
-            exit(EXIT_FAILURE);
-          }
-          rewind(f);
-
-          if (style->stripNewlines) {
-            for (int i = 0; i < size; i++) {
-              if (buffer[i] == '\n') {
-                buffer[i] = ' ';
-              }
-            }
-          }
-
-          pango_layout_set_markup(layout, buffer, -1);
-        }
+      size_t size;
+      markup = readIncluded(content->valuestring + strlen("INCLUDE:"), style->stripNewlines,
+                            &size);
+      if (!markup) {
+        return 0;
       }
+      length = size;
 
       /*
      * Replace the text of the current element with the DSML version and
      * checksums required to build the document.
      */
     } else if (strcmp(content->valuestring, "REV") == 0) {
-      char buf[256];
       snprintf(buf, 255, "%s:%x:%x", DSML_VERSION, contentChecksum, stylesheetChecksum);
-      pango_layout_set_markup(layout, buf, -1);
+      markup = buf;
 
       /*
      * Reproduce the text verbatim.
      */
     } else {
-      pango_layout_set_markup(layout, content->valuestring, -1);
+      markup = content->valuestring;
+    }
+    if (length < 0) {
+      length = strlen(markup);
     }
 
     /*
-     * Render the text
+     * Configure the style of text that is to be displayed
+     */
+    cairo_set_source_rgba(cr, style->r, style->g, style->b, style->a);
+
+    /*
+     * Paragraphs that have been shaped before are drawn straight from their
+     * cached glyphs. Otherwise, the shared layout is set up from scratch, since
+     * every property may have been changed by the previous paragraph. Drafts
+     * are shaped with other font options, so they never use the cache.
      */
-    cairo_tag_begin(cr, CAIRO_TAG_LINK, style->uri);
-    cairo_move_to(cr, style->x, style->y);
-    pango_cairo_show_layout(cr, layout);
-    cairo_tag_end(cr, CAIRO_TAG_LINK);
+    PangoLayout *layout = getLayout(cr);
+    const shapedText *shaped = NULL;
+    if (!draft) {
+      shaped = findShapedText(pango_layout_get_context(layout), markup, length, style);
+    }
+    if (!shaped) {
+      beginPhase(PHASE_LAYOUT);
+      if (profiling) {
+        countEvent(COUNT_LAYOUTS);
+      }
+      pango_layout_set_font_description(layout, getFont(style->face, style->size));
+      pango_layout_set_justify(layout, TRUE);
+      pango_layout_set_line_spacing(layout, style->spacing);
+      pango_layout_set_width(layout, style->width != 0 ? PANGO_SCALE * style->width : -1);
+      if (style->textAlign == ALIGN_CENTER) {
+        pango_layout_set_alignment(layout, PANGO_ALIGN_CENTER);
+      } else if (style->textAlign == ALIGN_RIGHT) {
+        pango_layout_set_alignment(layout, PANGO_ALIGN_RIGHT);
+      } else {
+        pango_layout_set_alignment(layout, PANGO_ALIGN_LEFT);
+      }
+      pango_layout_set_markup(layout, markup, length);
+      if (!draft) {
+        shaped = saveShapedText(layout, markup, length, style);
+      }
+      endPhase(PHASE_LAYOUT);
+    }
+
+    if (style->textAlign == ALIGN_CENTER) {
+      if (style->width == 0) {
+        fprintf(stderr, "Alignment set to 'center', but missing width.\n");
+      }
+      style->x -= style->width / 2.;
+    } else if (style->textAlign == ALIGN_RIGHT) {
+      if (style->width == 0) {
+        fprintf(stderr, "Alignment set to 'right', but missing width.\n");
+      }
+      style->x -= style->width;
+    }
 
     /*
-     * Cleanup
+     * Render the text
      */
-    g_object_unref(layout);
-    pango_font_description_free(font_description);
+    beginPhase(PHASE_DRAW);
+    if (draft == DRAFT_BOXES) {
+      outlineLayout(cr, layout, style->x, style->y);
+    }
+    if (!draft) {
+      cairo_tag_begin(cr, CAIRO_TAG_LINK, style->uri);
+    }
+    /*
+     * Text that starts below the band, such as a footer, is drawn where it was
+     * placed rather than starting a page of its own
+     */
+    if (flow.enabled && style->y < flow.bottom) {
+      shift = flowText(cr, shaped, layout, style);
+    } else if (shaped) {
+      drawShapedText(cr, shaped, style->x, style->y);
+    } else {
+      cairo_move_to(cr, style->x, style->y);
+      pango_cairo_show_layout(cr, layout);
+    }
+    if (!draft) {
+      cairo_tag_end(cr, CAIRO_TAG_LINK);
+    }
+    endPhase(PHASE_DRAW);
   }
+  return shift;
 }
@@ -3,9 +3,43 @@
 
 #include "style.h"
 
+struct options;
+
+/*
+ * Draft mode, set before any rendering threads start. Images are drawn as
+ * placeholders, links are left out, and text is laid out without hinting or
+ * the shape cache. With DRAFT_BOXES, the extents of each text are outlined.
+ */
+enum { DRAFT_OFF = 0,
+       DRAFT_ON = 1,
+       DRAFT_BOXES = 2 };
+
+extern int draft;
+
+/*
+ * A list of recorded pages, in order.
+ */
+typedef struct pageList {
+  cairo_pattern_t **pages;
+  int count;
+  int size;
+} pageList;
+
 void setContentChecksum(unsigned int checksum);
+unsigned int getContentChecksum();
 void setStylesheetChecksum(unsigned int checksum);
-void renderText(cairo_t *cr, cJSON *content, style *style);
+void printTextStats();
+void freeRenderCaches();
+void recordPages(cairo_t *cr, pageList *pages);
+void finishPages(cairo_t *cr);
+void freePages(pageList *pages);
+void showPage(cairo_t *cr);
+void setPageFlow(const struct options *options);
+int isFlowing();
+void holdPageBreak(cJSON *content);
+unsigned long getPageBreaks();
+int isPageBreak(cJSON *content);
+float renderText(cairo_t *cr, cJSON *content, style *style);
 void handleImages(cairo_t *cr, cJSON *stylesheet, style *style);
 
 #endif
@@ -0,0 +1,630 @@
+#include <cjson/cJSON.h>
+#include <errno.h>
+#include <pango/pangocairo.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "io.h"
+#include "shape.h"
+
+/*
+ * Limits on the memory used by the cache of each rendering thread, and on the
+ * total size of the files in the cache directory.
+ */
+#define SHAPE_MEMORY_LIMIT (64UL * 1024 * 1024)
+#define SHAPE_DISK_LIMIT (256UL * 1024 * 1024)
+#define SHAPE_BUCKETS 4096
+#define SHAPE_MAGIC "DSML2SHAPE2\n"
+
+/*
+ * The deepest embedding level that the bidirectional algorithm can resolve:
+ * 125 explicit levels, plus one for implicit runs.
+ */
+#define BIDI_MAX_LEVEL 126
+
+/*
+ * One shaped run of a laid out paragraph: its glyphs, the font they come from,
+ * the text they were shaped from, the position of its baseline relative to the
+ * top left of the layout, and the vertical extent of the line it is on.
+ */
+typedef struct shapedRun {
+  PangoItem *item;
+  PangoGlyphString *glyphs;
+  char *text;
+  double x;
+  double y;
+  double top;
+  double bottom;
+  int colored;
+  double r;
+  double g;
+  double b;
+} shapedRun;
+
+/*
+ * A laid out paragraph, keyed by its markup and everything in the style that
+ * affects its shape. Entries are kept in a hash table and in a list ordered by
+ * last use, from which the least recently used are evicted.
+ */
+struct shapedText {
+  unsigned long hash;
+  char *key;
+  size_t keyLength;
+  int runCount;
+  shapedRun *runs;
+  size_t bytes;
+  shapedText *chain;
+  shapedText *newer;
+  shapedText *older;
+};
+
+typedef struct shapeCache {
+  shapedText **buckets;
+  shapedText *newest;
+  shapedText *oldest;
+  size_t bytes;
+  unsigned long hits;
+  unsigned long diskHits;
+  unsigned long misses;
+  unsigned long uncacheable;
+  unsigned long evictions;
+} shapeCache;
+
+static _Thread_local shapeCache cache;
+
+/*
+ * The on-disk cache is shared by every thread, and is only set up before any
+ * of them start.
+ */
+static char *directory;
+
+static void *allocate(size_t count, size_t size) {
+  void *p = calloc(count, size);
+  if (!p) {
+    fprintf(stderr, "Could not allocate shaped text.\n");
+    exit(EXIT_FAILURE);
+  }
+  return p;
+}
+
+static unsigned long hashBytes(unsigned long hash, const char *s, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (unsigned char)s[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+/*
+ * Write the parts of the style that affect shaping into a buffer. Together
+ * with the markup, this is the cache key.
+ */
+static int styleKey(char *buffer, size_t size, const style *style) {
+  int length = snprintf(buffer, size, "%s\037%g\037%g\037%g\037%d\037", style->face,
+                        style->size, style->width, style->spacing, style->textAlign);
+  return length < (int)size ? length : -1;
+}
+
+static int keyMatches(const shapedText *shaped, const char *header, size_t headerLength,
+                      const char *markup, size_t length) {
+  return shaped->keyLength == headerLength + length &&
+         memcmp(shaped->key, header, headerLength) == 0 &&
+         memcmp(shaped->key + headerLength, markup, length) == 0;
+}
+
+static shapedText *newShapedText(unsigned long hash, const char *header, size_t headerLength,
+                                 const char *markup, size_t length) {
+  shapedText *shaped = allocate(1, sizeof(shapedText));
+  shaped->hash = hash;
+  shaped->keyLength = headerLength + length;
+  shaped->key = allocate(shaped->keyLength + 1, 1);
+  memcpy(shaped->key, header, headerLength);
+  memcpy(shaped->key + headerLength, markup, length);
+  return shaped;
+}
+
+static void freeShapedText(shapedText *shaped) {
+  for (int i = 0; i < shaped->runCount; i++) {
+    pango_item_free(shaped->runs[i].item);
+    pango_glyph_string_free(shaped->runs[i].glyphs);
+    free(shaped->runs[i].text);
+  }
+  free(shaped->runs);
+  free(shaped->key);
+  free(shaped);
+}
+
+static void measureShapedText(shapedText *shaped) {
+  shaped->bytes = sizeof(shapedText) + shaped->keyLength + shaped->runCount * sizeof(shapedRun);
+  for (int i = 0; i < shaped->runCount; i++) {
+    shaped->bytes += shaped->runs[i].item->length +
+                     shaped->runs[i].glyphs->num_glyphs * (sizeof(PangoGlyphInfo) + sizeof(gint));
+  }
+}
+
+static void unlinkRecent(shapedText *shaped) {
+  if (shaped->newer) {
+    shaped->newer->older = shaped->older;
+  } else {
+    cache.newest = shaped->older;
+  }
+  if (shaped->older) {
+    shaped->older->newer = shaped->newer;
+  } else {
+    cache.oldest = shaped->newer;
+  }
+  shaped->newer = NULL;
+  shaped->older = NULL;
+}
+
+static void linkRecent(shapedText *shaped) {
+  shaped->older = cache.newest;
+  if (cache.newest) {
+    cache.newest->newer = shaped;
+  }
+  cache.newest = shaped;
+  if (!cache.oldest) {
+    cache.oldest = shaped;
+  }
+}
+
+static void evict(shapedText *shaped) {
+  shapedText **link = &cache.buckets[shaped->hash % SHAPE_BUCKETS];
+  while (*link != shaped) {
+    link = &(*link)->chain;
+  }
+  *link = shaped->chain;
+  unlinkRecent(shaped);
+  cache.bytes -= shaped->bytes;
+  cache.evictions++;
+  freeShapedText(shaped);
+}
+
+/*
+ * Add an entry to the cache of the calling thread, evicting the least recently
+ * used entries to make room. The new entry itself is never evicted, since the
+ * caller is about to draw it.
+ */
+static void insert(shapedText *shaped) {
+  if (!cache.buckets) {
+    cache.buckets = allocate(SHAPE_BUCKETS, sizeof(shapedText *));
+  }
+  shapedText **bucket = &cache.buckets[shaped->hash % SHAPE_BUCKETS];
+  shaped->chain = *bucket;
+  *bucket = shaped;
+  linkRecent(shaped);
+  cache.bytes += shaped->bytes;
+  while (cache.bytes > SHAPE_MEMORY_LIMIT && cache.oldest != shaped) {
+    evict(cache.oldest);
+  }
+}
+
+static void cachePath(char *path, size_t size, unsigned long hash) {
+  snprintf(path, size, "%s/%016lx.shape", directory, hash);
+}
+
+/*
+ * Helpers for the cache file format: native byte order, since the files are
+ * only ever read back on the same machine.
+ */
+static int readBytes(FILE *f, void *p, size_t size) {
+  return fread(p, 1, size, f) == size;
+}
+
+static int writeBytes(FILE *f, const void *p, size_t size) {
+  return fwrite(p, 1, size, f) == size;
+}
+
+static int readString(FILE *f, char **s, uint32_t *length) {
+  if (!readBytes(f, length, sizeof(*length)) || *length > (1U << 30)) {
+    return 0;
+  }
+  *s = allocate(*length + 1, 1);
+  return readBytes(f, *s, *length);
+}
+
+static int writeString(FILE *f, const char *s, uint32_t length) {
+  return writeBytes(f, &length, sizeof(length)) && writeBytes(f, s, length);
+}
+
+/*
+ * Read a run from a cache file. Fonts are stored by description, and loaded
+ * through the given context. A run is rejected unless its character count,
+ * embedding level and clusters all fit its text, since Pango trusts them when
+ * it draws.
+ */
+static int readRun(FILE *f, PangoContext *context, shapedRun *run) {
+  char *name = NULL;
+  uint32_t length;
+  int32_t header[4];
+  int ok = readString(f, &name, &length) &&
+           readString(f, &run->text, &length) &&
+           readBytes(f, header, sizeof(header)) &&
+           readBytes(f, &run->x, sizeof(run->x)) &&
+           readBytes(f, &run->y, sizeof(run->y)) &&
+           readBytes(f, &run->top, sizeof(run->top)) &&
+           readBytes(f, &run->bottom, sizeof(run->bottom)) &&
+           readBytes(f, &run->r, sizeof(run->r)) &&
+           readBytes(f, &run->g, sizeof(run->g)) &&
+           readBytes(f, &run->b, sizeof(run->b)) &&
+           g_utf8_validate(run->text, length, NULL) &&
+           header[0] == g_utf8_strlen(run->text, length) &&
+           header[1] >= 0 && header[1] <= BIDI_MAX_LEVEL &&
+           header[2] >= 0 && header[2] < (1 << 24);
+
+  if (ok) {
+    PangoFontDescription *description = pango_font_description_from_string(name);
+    run->item = pango_item_new();
+    run->item->offset = 0;
+    run->item->length = length;
+    run->item->num_chars = header[0];
+    run->item->analysis.level = header[1];
+    run->item->analysis.font = pango_context_load_font(context, description);
+    run->colored = header[3];
+    pango_font_description_free(description);
+
+    run->glyphs = pango_glyph_string_new();
+    pango_glyph_string_set_size(run->glyphs, header[2]);
+    for (int i = 0; ok && i < header[2]; i++) {
+      int32_t glyph[6];
+      ok = readBytes(f, glyph, sizeof(glyph)) && glyph[5] >= 0 && (uint32_t)glyph[5] < length;
+      run->glyphs->glyphs[i].glyph = glyph[0];
+      run->glyphs->glyphs[i].geometry.width = glyph[1];
+      run->glyphs->glyphs[i].geometry.x_offset = glyph[2];
+      run->glyphs->glyphs[i].geometry.y_offset = glyph[3];
+      run->glyphs->glyphs[i].attr.is_cluster_start = glyph[4];
+      run->glyphs->log_clusters[i] = glyph[5];
+    }
+    ok = ok && run->item->analysis.font;
+  }
+  free(name);
+  return ok;
+}
+
+static int writeRun(FILE *f, const shapedRun *run) {
+  PangoFontDescription *description = pango_font_describe_with_absolute_size(run->item->analysis.font);
+  char *name = pango_font_description_to_string(description);
+  pango_font_description_free(description);
+
+  int32_t header[4] = {run->item->num_chars, run->item->analysis.level,
+                       run->glyphs->num_glyphs, run->colored};
+  int ok = writeString(f, name, strlen(name)) &&
+           writeString(f, run->text, run->item->length) &&
+           writeBytes(f, header, sizeof(header)) &&
+           writeBytes(f, &run->x, sizeof(run->x)) &&
+           writeBytes(f, &run->y, sizeof(run->y)) &&
+           writeBytes(f, &run->top, sizeof(run->top)) &&
+           writeBytes(f, &run->bottom, sizeof(run->bottom)) &&
+           writeBytes(f, &run->r, sizeof(run->r)) &&
+           writeBytes(f, &run->g, sizeof(run->g)) &&
+           writeBytes(f, &run->b, sizeof(run->b));
+  for (int i = 0; ok && i < run->glyphs->num_glyphs; i++) {
+    PangoGlyphInfo *info = &run->glyphs->glyphs[i];
+    int32_t glyph[6] = {info->glyph, info->geometry.width, info->geometry.x_offset,
+                        info->geometry.y_offset, info->attr.is_cluster_start,
+                        run->glyphs->log_clusters[i]};
+    ok = writeBytes(f, glyph, sizeof(glyph));
+  }
+  g_free(name);
+  return ok;
+}
+
+/*
+ * Look for a paragraph in the cache directory. Files are tagged with the Pango
+ * version, and hold the full key so that hash collisions are detected.
+ */
+static shapedText *loadShapedText(PangoContext *context, unsigned long hash, const char *header,
+                                  size_t headerLength, const char *markup, size_t length) {
+  char path[4096];
+  cachePath(path, sizeof(path), hash);
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return NULL;
+  }
+
+  char magic[sizeof(SHAPE_MAGIC) - 1];
+  int32_t version;
+  uint64_t keyLength;
+  int32_t runCount;
+  shapedText *shaped = NULL;
+  if (readBytes(f, magic, sizeof(magic)) && memcmp(magic, SHAPE_MAGIC, sizeof(magic)) == 0 &&
+      readBytes(f, &version, sizeof(version)) && version == pango_version() &&
+      readBytes(f, &keyLength, sizeof(keyLength)) && keyLength == headerLength + length) {
+    shaped = newShapedText(hash, header, headerLength, markup, length);
+    char *key = allocate(keyLength, 1);
+    int ok = readBytes(f, key, keyLength) &&
+             memcmp(key, shaped->key, keyLength) == 0 &&
+             readBytes(f, &runCount, sizeof(runCount)) &&
+             runCount >= 0 && runCount < (1 << 24);
+    free(key);
+
+    if (ok) {
+      shaped->runs = allocate(runCount ? runCount : 1, sizeof(shapedRun));
+      for (; ok && shaped->runCount < runCount; shaped->runCount++) {
+        ok = readRun(f, context, &shaped->runs[shaped->runCount]);
+      }
+    }
+    if (!ok) {
+      freeShapedText(shaped);
+      shaped = NULL;
+    }
+  }
+  fclose(f);
+
+  if (shaped) {
+    measureShapedText(shaped);
+    utime(path, NULL);
+  }
+  return shaped;
+}
+
+/*
+ * Write a paragraph to the cache directory. The file is written under a
+ * temporary name and renamed into place, so that other threads and processes
+ * never see a partial file.
+ */
+static void storeShapedText(const shapedText *shaped) {
+  char path[4096];
+  char temporary[4096];
+  cachePath(path, sizeof(path), shaped->hash);
+  snprintf(temporary, sizeof(temporary), "%s/.shape.XXXXXX", directory);
+  int fd = makeTemporary(temporary);
+  if (fd < 0) {
+    return;
+  }
+  FILE *f = fdopen(fd, "wb");
+  if (!f) {
+    close(fd);
+    unlink(temporary);
+    return;
+  }
+
+  int32_t version = pango_version();
+  uint64_t keyLength = shaped->keyLength;
+  int32_t runCount = shaped->runCount;
+  int ok = writeBytes(f, SHAPE_MAGIC, sizeof(SHAPE_MAGIC) - 1) &&
+           writeBytes(f, &version, sizeof(version)) &&
+           writeBytes(f, &keyLength, sizeof(keyLength)) &&
+           writeBytes(f, shaped->key, shaped->keyLength) &&
+           writeBytes(f, &runCount, sizeof(runCount));
+  for (int i = 0; ok && i < shaped->runCount; i++) {
+    ok = writeRun(f, &shaped->runs[i]);
+  }
+  if (fclose(f) != 0 || !ok || rename(temporary, path) != 0) {
+    unlink(temporary);
+  }
+}
+
+/*
+ * Use a directory to keep shaped text between runs, creating it if it does not
+ * exist. Must be called before any rendering threads start.
+ */
+void setShapeCacheDirectory(const char *path) {
+  if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create layout cache directory \"%s\".\n", path);
+    perror("mkdir");
+    exit(EXIT_FAILURE);
+  }
+  free(directory);
+  directory = strdup(path);
+  trimShapeCache();
+}
+
+/*
+ * Delete the least recently used files in the cache directory until it is
+ * back under its size limit.
+ */
+void trimShapeCache() {
+  if (directory) {
+    trimDirectory(directory, ".shape", SHAPE_DISK_LIMIT);
+  }
+}
+
+/*
+ * Look up a paragraph that has already been shaped, first in memory and then
+ * in the cache directory. Returns NULL on a miss. The result stays valid until
+ * the next call into the cache.
+ */
+const shapedText *findShapedText(PangoContext *context, const char *markup, int length,
+                                 const style *style) {
+  char header[320];
+  int headerLength = styleKey(header, sizeof(header), style);
+  if (headerLength < 0) {
+    cache.uncacheable++;
+    return NULL;
+  }
+  unsigned long hash = hashBytes(hashBytes(14695981039346656037UL, header, headerLength),
+                                 markup, length);
+
+  if (cache.buckets) {
+    for (shapedText *shaped = cache.buckets[hash % SHAPE_BUCKETS]; shaped; shaped = shaped->chain) {
+      if (shaped->hash == hash && keyMatches(shaped, header, headerLength, markup, length)) {
+        unlinkRecent(shaped);
+        linkRecent(shaped);
+        cache.hits++;
+        return shaped;
+      }
+    }
+  }
+
+  if (directory) {
+    shapedText *shaped = loadShapedText(context, hash, header, headerLength, markup, length);
+    if (shaped) {
+      insert(shaped);
+      cache.diskHits++;
+      return shaped;
+    }
+  }
+
+  cache.misses++;
+  return NULL;
+}
+
+/*
+ * Copy the glyph runs out of a layout that has just been set up for some
+ * markup, and add them to the cache. Layouts with decorations that are drawn
+ * separately from the glyphs, such as underlines or backgrounds, are not
+ * cached, and NULL is returned.
+ */
+const shapedText *saveShapedText(PangoLayout *layout, const char *markup, int length,
+                                 const style *style) {
+  char header[320];
+  int headerLength = styleKey(header, sizeof(header), style);
+  if (headerLength < 0) {
+    return NULL;
+  }
+  unsigned long hash = hashBytes(hashBytes(14695981039346656037UL, header, headerLength),
+                                 markup, length);
+  shapedText *shaped = newShapedText(hash, header, headerLength, markup, length);
+  const char *text = pango_layout_get_text(layout);
+
+  int size = 0;
+  int ok = 1;
+  PangoLayoutIter *iter = pango_layout_get_iter(layout);
+  do {
+    PangoLayoutRun *run = pango_layout_iter_get_run_readonly(iter);
+    if (!run) {
+      continue;
+    }
+
+    shapedRun r = {0};
+    for (GSList *l = run->item->analysis.extra_attrs; l; l = l->next) {
+      PangoAttribute *attr = l->data;
+      if (attr->klass->type == PANGO_ATTR_FOREGROUND) {
+        PangoColor *color = &((PangoAttrColor *)attr)->color;
+        r.colored = 1;
+        r.r = color->red / 65535.;
+        r.g = color->green / 65535.;
+        r.b = color->blue / 65535.;
+      } else {
+        ok = 0;
+      }
+    }
+    if (!ok || run->y_offset) {
+      ok = 0;
+      break;
+    }
+
+    PangoRectangle logical;
+    int top;
+    int bottom;
+    pango_layout_iter_get_run_extents(iter, NULL, &logical);
+    pango_layout_iter_get_line_yrange(iter, &top, &bottom);
+    r.x = (double)logical.x / PANGO_SCALE;
+    r.y = (double)pango_layout_iter_get_baseline(iter) / PANGO_SCALE;
+    r.top = (double)top / PANGO_SCALE;
+    r.bottom = (double)bottom / PANGO_SCALE;
+    r.item = pango_item_new();
+    r.item->offset = 0;
+    r.item->length = run->item->length;
+    r.item->num_chars = run->item->num_chars;
+    r.item->analysis.level = run->item->analysis.level;
+    r.item->analysis.font = g_object_ref(run->item->analysis.font);
+    r.text = allocate(run->item->length + 1, 1);
+    memcpy(r.text, text + run->item->offset, run->item->length);
+    r.glyphs = pango_glyph_string_copy(run->glyphs);
+
+    if (shaped->runCount == size) {
+      size = size ? size * 2 : 8;
+      shaped->runs = realloc(shaped->runs, size * sizeof(shapedRun));
+      if (!shaped->runs) {
+        fprintf(stderr, "Could not allocate shaped text.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    shaped->runs[shaped->runCount++] = r;
+  } while (pango_layout_iter_next_run(iter));
+  pango_layout_iter_free(iter);
+
+  if (!ok) {
+    cache.uncacheable++;
+    freeShapedText(shaped);
+    return NULL;
+  }
+
+  measureShapedText(shaped);
+  insert(shaped);
+  if (directory) {
+    storeShapedText(shaped);
+  }
+  return shaped;
+}
+
+/*
+ * Draw a run of a cached paragraph whose top left corner is at a point, in the
+ * current source color. The run is drawn together with its text, so that the
+ * text in the output remains searchable.
+ */
+static void drawRun(cairo_t *cr, const shapedRun *run, double x, double y) {
+  PangoGlyphItem glyphItem = {0};
+  glyphItem.item = run->item;
+  glyphItem.glyphs = run->glyphs;
+
+  if (run->colored) {
+    cairo_save(cr);
+    cairo_set_source_rgb(cr, run->r, run->g, run->b);
+  }
+  cairo_move_to(cr, x + run->x, y + run->y);
+  pango_cairo_show_glyph_item(cr, run->text, &glyphItem);
+  if (run->colored) {
+    cairo_restore(cr);
+  }
+}
+
+/*
+ * Draw a cached paragraph with its top left corner at a point
+ */
+void drawShapedText(cairo_t *cr, const shapedText *shaped, double x, double y) {
+  for (int i = 0; i < shaped->runCount; i++) {
+    drawRun(cr, &shaped->runs[i], x, y);
+  }
+}
+
+/*
+ * Draw the lines of a cached paragraph that start at or below the height
+ * `from` within it, until one would end below the height `to`. If `force` is
+ * set, the first of those lines is drawn even if it does not fit. Returns the
+ * height at which the first line that was not drawn starts, or -1 if every
+ * line was drawn.
+ */
+double drawShapedLines(cairo_t *cr, const shapedText *shaped, double x, double y,
+                       double from, double to, int force) {
+  double first = -1;
+  for (int i = 0; i < shaped->runCount; i++) {
+    shapedRun *run = &shaped->runs[i];
+    if (run->top < from) {
+      continue;
+    }
+    if (first < 0) {
+      first = run->top;
+    }
+    if (run->bottom > to && !(force && run->top == first)) {
+      return run->top;
+    }
+    drawRun(cr, run, x, y);
+  }
+  return -1;
+}
+
+void printShapeStats() {
+  fprintf(stdout, "Shaped text: %lu hits, %lu from disk, %lu shaped, %lu not cacheable, %lu evicted\n",
+          cache.hits, cache.diskHits, cache.misses, cache.uncacheable, cache.evictions);
+}
+
+/*
+ * Release the shaped text cached by the calling thread.
+ */
+void freeShapeCache() {
+  while (cache.oldest) {
+    shapedText *shaped = cache.oldest;
+    unlinkRecent(shaped);
+    freeShapedText(shaped);
+  }
+  free(cache.buckets);
+  memset(&cache, 0, sizeof(cache));
+}
@@ -0,0 +1,20 @@
+#ifndef SHAPE_H
+#define SHAPE_H
+
+#include "style.h"
+
+typedef struct shapedText shapedText;
+
+void setShapeCacheDirectory(const char *path);
+void trimShapeCache();
+const shapedText *findShapedText(PangoContext *context, const char *markup, int length,
+                                 const style *style);
+const shapedText *saveShapedText(PangoLayout *layout, const char *markup, int length,
+                                 const style *style);
+void drawShapedText(cairo_t *cr, const shapedText *shaped, double x, double y);
+double drawShapedLines(cairo_t *cr, const shapedText *shaped, double x, double y,
+                       double from, double to, int force);
+void printShapeStats();
+void freeShapeCache();
+
+#endif
@@ -0,0 +1,195 @@
+#include <cjson/cJSON.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "stream.h"
+
+/*
+ * Size of each read from the content file
+ */
+#define STREAM_CHUNK 65536
+
+/*
+ * A content file that is read one top level member at a time. The buffer
+ * holds the unparsed remainder of the most recent reads.
+ */
+struct contentStream {
+  FILE *f;
+  char *buffer;
+  size_t size;
+  size_t capacity;
+  size_t position;
+  int done;
+};
+
+/*
+ * Generate a checksum from a file stream without holding it in memory, and
+ * rewind it so that it can be read again.
+ */
+unsigned int checksumStream(FILE *f) {
+  unsigned char buffer[STREAM_CHUNK];
+  unsigned long crc = crc32(0L, Z_NULL, 0);
+  size_t ret;
+  while ((ret = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    crc = crc32(crc, buffer, ret);
+  }
+  if (ferror(f) || fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Streaming mode needs a content file that can be read twice.\n");
+    exit(EXIT_FAILURE);
+  }
+  return crc;
+}
+
+static void streamError(const char *message) {
+  fprintf(stderr, "Content: %s.\n", message);
+  exit(EXIT_FAILURE);
+}
+
+/*
+ * Make sure that the byte at `offset` from the current position is in the
+ * buffer. Returns zero at the end of the file. Already parsed data is dropped
+ * from the front of the buffer first.
+ */
+static int fill(contentStream *stream, size_t offset) {
+  while (stream->position + offset >= stream->size) {
+    if (stream->position) {
+      memmove(stream->buffer, stream->buffer + stream->position, stream->size - stream->position);
+      stream->size -= stream->position;
+      stream->position = 0;
+    }
+    if (stream->size + STREAM_CHUNK > stream->capacity) {
+      stream->capacity = stream->capacity ? stream->capacity * 2 : STREAM_CHUNK * 2;
+      stream->buffer = realloc(stream->buffer, stream->capacity);
+      if (!stream->buffer) {
+        fprintf(stderr, "Could not allocate stream buffer.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    size_t ret = fread(stream->buffer + stream->size, 1, STREAM_CHUNK, stream->f);
+    if (ret == 0) {
+      if (ferror(stream->f)) {
+        streamError("read error");
+      }
+      return 0;
+    }
+    stream->size += ret;
+  }
+  return 1;
+}
+
+static void skipSpace(contentStream *stream) {
+  while (fill(stream, 0) && strchr(" \t\r\n", stream->buffer[stream->position])) {
+    stream->position++;
+  }
+}
+
+/*
+ * Start reading a content file, which must hold a single JSON object.
+ */
+contentStream *openContentStream(FILE *f) {
+  contentStream *stream = calloc(1, sizeof(contentStream));
+  if (!stream) {
+    fprintf(stderr, "Could not allocate stream.\n");
+    exit(EXIT_FAILURE);
+  }
+  stream->f = f;
+  skipSpace(stream);
+  if (!fill(stream, 0) || stream->buffer[stream->position] != '{') {
+    streamError("expected an object");
+  }
+  stream->position++;
+  return stream;
+}
+
+/*
+ * Read the next member of the root object and return it as a detached node
+ * with its key, or NULL after the last member. Only the text of that member
+ * is scanned, tracking strings and nesting to find where it ends, and then
+ * parsed with cJSON. The caller owns the node.
+ */
+cJSON *nextMember(contentStream *stream) {
+  if (stream->done) {
+    return NULL;
+  }
+  skipSpace(stream);
+  if (!fill(stream, 0)) {
+    streamError("unexpected end of file");
+  }
+  if (stream->buffer[stream->position] == '}') {
+    stream->done = 1;
+    return NULL;
+  }
+
+  /*
+   * Find the end of the member: the comma or closing brace at depth zero that
+   * follows it
+   */
+  size_t end = 0;
+  int depth = 0;
+  int inString = 0;
+  int colon = 0;
+  while (1) {
+    if (!fill(stream, end)) {
+      streamError("unexpected end of file");
+    }
+    char c = stream->buffer[stream->position + end];
+    if (inString) {
+      if (c == '\\') {
+        end++;
+      } else if (c == '"') {
+        inString = 0;
+      }
+    } else if (c == '"') {
+      inString = 1;
+    } else if (c == ':') {
+      colon = 1;
+    } else if (c == '{' || c == '[') {
+      depth++;
+    } else if (c == '}' || c == ']') {
+      if (depth == 0) {
+        break;
+      }
+      depth--;
+    } else if (c == ',' && depth == 0) {
+      break;
+    }
+    end++;
+  }
+  if (!colon) {
+    streamError("expected a key and a value");
+  }
+
+  /*
+   * Parse the member on its own, wrapped in braces so that cJSON handles the
+   * key
+   */
+  char *text = malloc(end + 2);
+  if (!text) {
+    fprintf(stderr, "Could not allocate stream buffer.\n");
+    exit(EXIT_FAILURE);
+  }
+  text[0] = '{';
+  memcpy(text + 1, stream->buffer + stream->position, end);
+  text[end + 1] = '}';
+  cJSON *object = cJSON_ParseWithLength(text, end + 2);
+  free(text);
+  if (!object || !object->child) {
+    streamError("invalid member");
+  }
+
+  stream->position += end;
+  if (stream->buffer[stream->position] == ',') {
+    stream->position++;
+  }
+
+  cJSON *member = cJSON_DetachItemViaPointer(object, object->child);
+  cJSON_Delete(object);
+  return member;
+}
+
+void closeContentStream(contentStream *stream) {
+  free(stream->buffer);
+  free(stream);
+}
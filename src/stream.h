@@ -0,0 +1,11 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+typedef struct contentStream contentStream;
+
+unsigned int checksumStream(FILE *f);
+contentStream *openContentStream(FILE *f);
+cJSON *nextMember(contentStream *stream);
+void closeContentStream(contentStream *stream);
+
+#endif
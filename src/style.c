@@ -7,122 +7,277 @@
 #include <zlib.h>
 
 #include "dsml2.h"
+#include "index.h"
+#include "lua.h"
 #include "render.h"
 #include "style.h"
 #include "traverse.h"
 
 /*
- * Macros for applying style information.
+ * Every record that has been compiled, so that they can be freed together.
  */
-#define ADD_STYLE_DOUBLE(e, a, b) \
-  {                               \
-    cJSON *s = find(e, a);        \
-    if (s) {                      \
-      luaEval(s, L);              \
-      b += s->valuedouble;        \
-    }                             \
+static styleRecord *records;
+
+/*
+ * Macros for compiling style information.
+ */
+#define COMPILE_STYLE_DOUBLE(e, a, b, f) \
+  {                                      \
+    cJSON *s = find(e, a);               \
+    if (s) {                             \
+      b = styleValue(s, L);              \
+      record->fields |= f;               \
+    }                                    \
   }
 
-#define APPLY_STYLE_DOUBLE(e, a, b) \
-  {                                 \
-    cJSON *s = find(e, a);          \
-    if (s) {                        \
-      luaEval(s, L);                \
-      b = s->valuedouble;           \
-    }                               \
+#define COMPILE_LINE_DOUBLE(e, a, b) \
+  {                                  \
+    cJSON *s = find(e, a);           \
+    if (s) {                         \
+      b = styleValue(s, L);          \
+    }                                \
   }
 
 /*
- * Evaluate an arithmetic expression in the `valuestring` field of the cJSON
- * struct, and place the floating point contents into the `valuedouble` field.
- * Cause program exit on invalid input.
+ * Evaluate a style value, which is either a number or an arithmetic expression
+ * in a string. Cause program exit on invalid input.
  */
-void luaEval(cJSON *c, lua_State *L) {
+static float styleValue(cJSON *c, lua_State *L) {
   if (cJSON_IsString(c)) {
-    lua_getglobal(L, "eval");
-    lua_pushstring(L, c->valuestring);
-    int error = lua_pcall(L, 1, 1, 0);
-    c->valuedouble = lua_tonumber(L, -1);
-    if (error) {
-      fprintf(stderr, "%s\n", lua_tostring(L, -1));
-      exit(EXIT_FAILURE);
-    }
+    return luaEvalString(L, c->valuestring);
   }
+  return c->valuedouble;
 }
 
-void applyStyles(cairo_t *cr, cJSON *styleElement, struct style *style, lua_State *L) {
-  if (styleElement) {
-    ADD_STYLE_DOUBLE(styleElement, "x", style->x)
-    ADD_STYLE_DOUBLE(styleElement, "y", style->y)
-    APPLY_STYLE_DOUBLE(styleElement, "r", style->r)
-    APPLY_STYLE_DOUBLE(styleElement, "g", style->g)
-    APPLY_STYLE_DOUBLE(styleElement, "b", style->b)
-    APPLY_STYLE_DOUBLE(styleElement, "a", style->a)
-    APPLY_STYLE_DOUBLE(styleElement, "size", style->size)
-    APPLY_STYLE_DOUBLE(styleElement, "spacing", style->spacing)
-    APPLY_STYLE_DOUBLE(styleElement, "width", style->width)
-    APPLY_STYLE_DOUBLE(styleElement, "textWidth", style->textWidth)
-    APPLY_STYLE_DOUBLE(styleElement, "lineHeight", style->lineHeight)
-    cJSON *stripNewlines = find(styleElement, "stripNewlines");
-    if (stripNewlines) {
-      if (cJSON_IsBool(stripNewlines)) {
-        if (cJSON_IsTrue(stripNewlines)) {
-          style->stripNewlines = 1;
-        }
-      }
+/*
+ * Turn a "_style" element into a record, evaluating all expressions and
+ * parsing all strings.
+ */
+static styleRecord *compileRecord(cJSON *styleElement, lua_State *L) {
+  styleRecord *record = calloc(1, sizeof(styleRecord));
+  if (!record) {
+    fprintf(stderr, "Could not allocate style record.\n");
+    exit(EXIT_FAILURE);
+  }
+  record->next = records;
+  records = record;
+
+  COMPILE_STYLE_DOUBLE(styleElement, "x", record->x, STYLE_X)
+  COMPILE_STYLE_DOUBLE(styleElement, "y", record->y, STYLE_Y)
+  COMPILE_STYLE_DOUBLE(styleElement, "r", record->r, STYLE_R)
+  COMPILE_STYLE_DOUBLE(styleElement, "g", record->g, STYLE_G)
+  COMPILE_STYLE_DOUBLE(styleElement, "b", record->b, STYLE_B)
+  COMPILE_STYLE_DOUBLE(styleElement, "a", record->a, STYLE_A)
+  COMPILE_STYLE_DOUBLE(styleElement, "size", record->size, STYLE_SIZE)
+  COMPILE_STYLE_DOUBLE(styleElement, "spacing", record->spacing, STYLE_SPACING)
+  COMPILE_STYLE_DOUBLE(styleElement, "width", record->width, STYLE_WIDTH)
+  COMPILE_STYLE_DOUBLE(styleElement, "textWidth", record->textWidth, STYLE_TEXT_WIDTH)
+  COMPILE_STYLE_DOUBLE(styleElement, "lineHeight", record->lineHeight, STYLE_LINE_HEIGHT)
+  COMPILE_STYLE_DOUBLE(styleElement, "xOffset", record->xOffset, STYLE_X_OFFSET)
+  COMPILE_STYLE_DOUBLE(styleElement, "yOffset", record->yOffset, STYLE_Y_OFFSET)
+
+  cJSON *stripNewlines = find(styleElement, "stripNewlines");
+  if (stripNewlines && cJSON_IsTrue(stripNewlines)) {
+    record->fields |= STYLE_STRIP_NEWLINES;
+  }
+  cJSON *face = find(styleElement, "face");
+  if (face && cJSON_IsString(face)) {
+    record->face = intern(face->valuestring);
+    record->fields |= STYLE_FACE;
+  }
+  cJSON *uri = find(styleElement, "URI");
+  if (uri && cJSON_IsString(uri)) {
+    record->uri = intern(uri->valuestring);
+    record->fields |= STYLE_URI;
+  }
+  cJSON *textAlign = find(styleElement, "textAlign");
+  if (textAlign && cJSON_IsString(textAlign)) {
+    record->fields |= STYLE_TEXT_ALIGN;
+    if (strcmp("center", textAlign->valuestring) == 0) {
+      record->textAlign = ALIGN_CENTER;
+    } else if (strcmp("left", textAlign->valuestring) == 0) {
+      record->textAlign = ALIGN_LEFT;
+    } else if (strcmp("right", textAlign->valuestring) == 0) {
+      record->textAlign = ALIGN_RIGHT;
+    } else {
+      record->fields &= ~STYLE_TEXT_ALIGN;
     }
-    cJSON *face = find(styleElement, "face");
-    if (face) {
-      strcpy(style->face, face->valuestring);
+  }
+
+  /*
+   * Lines are drawn in the order in which they appear
+   */
+  for (cJSON *node = styleElement->child; node; node = node->next) {
+    if (strcmp("line", node->string) == 0) {
+      record->lineCount++;
     }
-    cJSON *uri = find(styleElement, "URI");
-    if (uri) {
-      strcpy(style->uri, uri->valuestring);
+  }
+  if (record->lineCount) {
+    record->lines = calloc(record->lineCount, sizeof(styleLine));
+    if (!record->lines) {
+      fprintf(stderr, "Could not allocate style record.\n");
+      exit(EXIT_FAILURE);
     }
-    cJSON *textAlign = find(styleElement, "textAlign");
-    if (textAlign) {
-      if (strcmp("center", textAlign->valuestring) == 0) {
-        style->textAlign = ALIGN_CENTER;
-      } else if (strcmp("left", textAlign->valuestring) == 0) {
-        style->textAlign = ALIGN_LEFT;
-      } else if (strcmp("right", textAlign->valuestring) == 0) {
-        style->textAlign = ALIGN_RIGHT;
-      }
+  }
+  styleLine *line = record->lines;
+  for (cJSON *node = styleElement->child; node; node = node->next) {
+    if (strcmp("line", node->string) == 0) {
+      line->a = 1;
+      line->width = 1;
+      COMPILE_LINE_DOUBLE(node, "x1", line->x1);
+      COMPILE_LINE_DOUBLE(node, "x2", line->x2);
+      COMPILE_LINE_DOUBLE(node, "y1", line->y1);
+      COMPILE_LINE_DOUBLE(node, "y2", line->y2);
+      COMPILE_LINE_DOUBLE(node, "width", line->width);
+      COMPILE_LINE_DOUBLE(node, "r", line->r);
+      COMPILE_LINE_DOUBLE(node, "g", line->g);
+      COMPILE_LINE_DOUBLE(node, "b", line->b);
+      COMPILE_LINE_DOUBLE(node, "a", line->a);
+      line++;
     }
-    cJSON *contentNode = styleElement->child;
-    while (1) {
-      if (!contentNode) {
-        break;
-      }
-      if (strcmp("line", contentNode->string) == 0) {
-        double x1, x2, y1, y2;
-        double r = 0;
-        double g = 0;
-        double b = 0;
-        double a = 1;
-        double lineWidth = 1;
-        APPLY_STYLE_DOUBLE(contentNode, "x1", x1);
-        APPLY_STYLE_DOUBLE(contentNode, "x2", x2);
-        APPLY_STYLE_DOUBLE(contentNode, "y1", y1);
-        APPLY_STYLE_DOUBLE(contentNode, "y2", y2);
-        APPLY_STYLE_DOUBLE(contentNode, "width", lineWidth);
-        APPLY_STYLE_DOUBLE(contentNode, "r", r);
-        APPLY_STYLE_DOUBLE(contentNode, "g", g);
-        APPLY_STYLE_DOUBLE(contentNode, "b", b);
-        APPLY_STYLE_DOUBLE(contentNode, "a", a);
-
-        x1 += style->x;
-        x2 += style->x;
-        y1 += style->y;
-        y2 += style->y;
-
-        cairo_set_source_rgba(cr, r, g, b, a);
-        cairo_set_line_width(cr, lineWidth);
-        cairo_move_to(cr, x1, y1);
-        cairo_line_to(cr, x2, y2);
-        cairo_stroke(cr);
+  }
+
+  return record;
+}
+
+/*
+ * Return the compiled form of a "_style" element, compiling it on first use.
+ * The record is attached to the element's index entry so that it is only ever
+ * compiled once.
+ */
+const styleRecord *getStyleRecord(cJSON *styleElement, lua_State *L) {
+  static const styleRecord emptyRecord;
+
+  if (!styleElement) {
+    return NULL;
+  }
+  if (!styleElement->child) {
+    return &emptyRecord;
+  }
+
+  void **slot = nodeData(styleElement);
+  if (!slot) {
+    indexTree(styleElement);
+    slot = nodeData(styleElement);
+  }
+  if (!*slot) {
+    *slot = compileRecord(styleElement, L);
+  }
+  return *slot;
+}
+
+/*
+ * Compile every "_style" element in the stylesheet up front, so that rendering
+ * never has to evaluate an expression.
+ */
+void compileStyles(cJSON *stylesheet, lua_State *L) {
+  for (cJSON *node = stylesheet->child; node; node = node->next) {
+    if (cJSON_IsObject(node)) {
+      if (strcmp(node->string, "_style") == 0) {
+        getStyleRecord(node, L);
+      } else if (strcmp(node->string, "_constants") != 0 &&
+                 strcmp(node->string, "_options") != 0) {
+        compileStyles(node, L);
       }
-      contentNode = contentNode->next;
     }
   }
 }
+
+/*
+ * Compile only the "_style" elements that drawing a content tree will use, by
+ * following along in the stylesheet the same way the traversal does. Constants
+ * that only unused styles refer to are then never evaluated.
+ */
+void compileUsedStyles(cJSON *content, cJSON *stylesheet, lua_State *L) {
+  getStyleRecord(find(stylesheet, "_style"), L);
+  for (cJSON *node = content->child; node; node = node->next) {
+    compileUsedStyles(node, find(stylesheet, node->string), L);
+  }
+}
+
+void freeStyleRecords() {
+  while (records) {
+    styleRecord *next = records->next;
+    free(records->lines);
+    free(records);
+    records = next;
+  }
+}
+
+/*
+ * Apply a compiled "_style" element to the current style without drawing
+ * anything.
+ */
+void inheritStyles(const styleRecord *record, struct style *style) {
+  if (!record) {
+    return;
+  }
+
+  unsigned int fields = record->fields;
+  if (fields & STYLE_X) {
+    style->x += record->x;
+  }
+  if (fields & STYLE_Y) {
+    style->y += record->y;
+  }
+  if (fields & STYLE_R) {
+    style->r = record->r;
+  }
+  if (fields & STYLE_G) {
+    style->g = record->g;
+  }
+  if (fields & STYLE_B) {
+    style->b = record->b;
+  }
+  if (fields & STYLE_A) {
+    style->a = record->a;
+  }
+  if (fields & STYLE_SIZE) {
+    style->size = record->size;
+  }
+  if (fields & STYLE_SPACING) {
+    style->spacing = record->spacing;
+  }
+  if (fields & STYLE_WIDTH) {
+    style->width = record->width;
+  }
+  if (fields & STYLE_TEXT_WIDTH) {
+    style->textWidth = record->textWidth;
+  }
+  if (fields & STYLE_LINE_HEIGHT) {
+    style->lineHeight = record->lineHeight;
+  }
+  if (fields & STYLE_STRIP_NEWLINES) {
+    style->stripNewlines = 1;
+  }
+  if (fields & STYLE_FACE) {
+    style->face = record->face;
+  }
+  if (fields & STYLE_URI) {
+    style->uri = record->uri;
+  }
+  if (fields & STYLE_TEXT_ALIGN) {
+    style->textAlign = record->textAlign;
+  }
+}
+
+/*
+ * Apply a compiled "_style" element to the current style, and draw any lines
+ * that it contains.
+ */
+void applyStyles(cairo_t *cr, const styleRecord *record, struct style *style) {
+  if (!record) {
+    return;
+  }
+
+  inheritStyles(record, style);
+
+  for (int i = 0; i < record->lineCount; i++) {
+    const styleLine *line = &record->lines[i];
+    cairo_set_source_rgba(cr, line->r, line->g, line->b, line->a);
+    cairo_set_line_width(cr, line->width);
+    cairo_move_to(cr, line->x1 + style->x, line->y1 + style->y);
+    cairo_line_to(cr, line->x2 + style->x, line->y2 + style->y);
+    cairo_stroke(cr);
+  }
+}
@@ -12,28 +12,99 @@ enum align {
 
 /*
  * Struct that holds information about the various styles that need to be
- * applied and propagated to children.
+ * applied and propagated to children. It is copied for every node, so it is
+ * kept to a single cache line: the face and URI point to interned strings, or
+ * to string literals for the defaults, rather than being copied.
  */
 typedef struct style {
   float x;
   float y;
-  float xOffset;
-  float yOffset;
   float size;
+  float width;
+  float spacing;
+  float r;
+  float g;
+  float b;
+  float a;
   float textWidth;
   float lineHeight;
-  float spacing;
+  unsigned char textAlign;
+  unsigned char stripNewlines;
+  const char *face;
+  const char *uri;
+} style;
+
+/*
+ * Bits that record which fields are present in a compiled "_style" element.
+ */
+enum styleField {
+  STYLE_X = 1 << 0,
+  STYLE_Y = 1 << 1,
+  STYLE_R = 1 << 2,
+  STYLE_G = 1 << 3,
+  STYLE_B = 1 << 4,
+  STYLE_A = 1 << 5,
+  STYLE_SIZE = 1 << 6,
+  STYLE_SPACING = 1 << 7,
+  STYLE_WIDTH = 1 << 8,
+  STYLE_TEXT_WIDTH = 1 << 9,
+  STYLE_LINE_HEIGHT = 1 << 10,
+  STYLE_X_OFFSET = 1 << 11,
+  STYLE_Y_OFFSET = 1 << 12,
+  STYLE_STRIP_NEWLINES = 1 << 13,
+  STYLE_FACE = 1 << 14,
+  STYLE_URI = 1 << 15,
+  STYLE_TEXT_ALIGN = 1 << 16,
+};
+
+/*
+ * A "line" element, relative to the position of the node that draws it.
+ */
+typedef struct styleLine {
+  float x1;
+  float y1;
+  float x2;
+  float y2;
+  float width;
   float r;
   float g;
   float b;
   float a;
+} styleLine;
+
+/*
+ * A "_style" element with every expression evaluated and every string parsed
+ * ahead of time, so that applying it does not touch the JSON tree. The face and
+ * URI are interned strings.
+ */
+typedef struct styleRecord {
+  unsigned int fields;
+  float x;
+  float y;
+  float r;
+  float g;
+  float b;
+  float a;
+  float size;
+  float spacing;
   float width;
-  int stripNewlines;
+  float textWidth;
+  float lineHeight;
+  float xOffset;
+  float yOffset;
   int textAlign;
-  char face[256];
-  char uri[256];
-} style;
+  const char *face;
+  const char *uri;
+  int lineCount;
+  styleLine *lines;
+  struct styleRecord *next;
+} styleRecord;
 
-void applyStyles(cairo_t *cr, cJSON *styleElement, struct style *style, lua_State *L);
+const styleRecord *getStyleRecord(cJSON *styleElement, lua_State *L);
+void compileStyles(cJSON *stylesheet, lua_State *L);
+void compileUsedStyles(cJSON *content, cJSON *stylesheet, lua_State *L);
+void freeStyleRecords();
+void inheritStyles(const styleRecord *record, struct style *style);
+void applyStyles(cairo_t *cr, const styleRecord *record, struct style *style);
 
 #endif
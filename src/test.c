@@ -1,7 +1,80 @@
 #include <assert.h>
+#include <cairo.h>
+#include <curl/curl.h>
+#include <lauxlib.h>
+#include <limits.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "dsml2.h"
+#include "expr.h"
+#include "fetch.h"
+#include "index.h"
 #include "io.h"
+#include "lua.h"
+#include "pages.h"
+#include "render.h"
+#include "stream.h"
+#include "style.h"
+#include "traverse.h"
+
+static int resolveHalfInch(const char *name, size_t length, double *value) {
+  if (length == strlen("halfinch") && strncmp(name, "halfinch", length) == 0) {
+    *value = 36;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Record the pages of a document, either in order or split at its page breaks
+ * and drawn on parallel threads
+ */
+static void recordDocument(pageList *pages, cJSON *content, cJSON *stylesheet, lua_State *L,
+                           options *options, int jobs) {
+  cairo_rectangle_t extents = {0, 0, options->pageWidth, options->pageHeight};
+  cairo_surface_t *surface = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+  cairo_t *cr = cairo_create(surface);
+  setPageFlow(options);
+  recordPages(cr, pages);
+  if (jobs < 2) {
+    simultaneous_traversal(cr, content, stylesheet, L, LOG_NONE);
+  } else {
+    assert(renderPages(cr, content, stylesheet, options, jobs, LOG_NONE) == 0);
+  }
+  finishPages(cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(surface);
+}
+
+/*
+ * Whether two lists of recorded pages rasterize to the same pixels
+ */
+static int samePages(pageList *a, pageList *b, int width, int height) {
+  if (a->count != b->count) {
+    return 0;
+  }
+  cairo_surface_t *x = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  cairo_surface_t *y = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+  int same = 1;
+  for (int i = 0; i < a->count && same; i++) {
+    cairo_surface_t *surfaces[2] = {x, y};
+    cairo_pattern_t *patterns[2] = {a->pages[i], b->pages[i]};
+    for (int j = 0; j < 2; j++) {
+      cairo_t *cr = cairo_create(surfaces[j]);
+      cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+      cairo_set_source(cr, patterns[j]);
+      cairo_paint(cr);
+      cairo_destroy(cr);
+      cairo_surface_flush(surfaces[j]);
+    }
+    same = memcmp(cairo_image_surface_get_data(x), cairo_image_surface_get_data(y),
+                  (size_t)cairo_image_surface_get_stride(x) * height) == 0;
+  }
+  cairo_surface_destroy(x);
+  cairo_surface_destroy(y);
+  return same;
+}
 
 int main() {
 
@@ -12,4 +85,136 @@ int main() {
 
   assert(checksum == 719410340);
   assert(strcmp(c->child->valuestring, "REV") == 0);
+
+  double value;
+  setConstant("oneinch", 72);
+  assert(evalArithmetic("(oneinch + 12) * 2", &value) && value == 168);
+  assert(evalArithmetic("-.5", &value) && value == -.5);
+  assert(!evalArithmetic("math.floor(oneinch / 5)", &value));
+  assert(!evalArithmetic("1 --2", &value));
+
+  setConstantResolver(resolveHalfInch);
+  assert(evalArithmetic("halfinch * 4 + oneinch", &value) && value == 216);
+  assert(!evalArithmetic("quarterinch", &value));
+  setConstantResolver(NULL);
+  clearConstants();
+
+  /*
+   * Constants may refer to ones defined after them, and are evaluated on first
+   * use whatever their order
+   */
+  cJSON *constants = cJSON_Parse(
+      "{\"_constants\": {\"area\": \"width * height\", \"width\": \"height * 2\", \"height\": 3}}");
+  lua_State *L = newLuaState();
+  collectConstants(constants, L);
+  assert(luaEvalString(L, "area") == 18);
+  assert(evalArithmetic("width + 1", &value) && value == 7);
+  lua_close(L);
+  cJSON_Delete(constants);
+  setConstantResolver(NULL);
+  clearConstants();
+
+  /*
+   * Stream a document whose stylesheet has no "_style" at its root
+   */
+  f = fopen("example/simple/stylesheet.json", "rb");
+  cJSON *stylesheet = readJSONFile(f);
+  fclose(f);
+  indexTree(stylesheet);
+  L = newLuaState();
+  collectConstants(stylesheet, L);
+  compileStyles(stylesheet, L);
+  options options = {0};
+  options.pageWidth = 8.5 * POINTS_PER_INCH;
+  options.pageHeight = 11 * POINTS_PER_INCH;
+  f = fopen("example/simple/content.json", "rb");
+  contentStream *stream = openContentStream(f);
+  assert(renderStream("build/stream.pdf", stream, stylesheet, L, &options, LOG_NONE) == 0);
+  closeContentStream(stream);
+  fclose(f);
+  lua_close(L);
+  cJSON_Delete(stylesheet);
+  cJSON_Delete(c);
+  freeRenderCaches();
+  freeStyleRecords();
+  freeIndex();
+  clearConstants();
+
+  /*
+   * A paragraph that flows onto a second page moves what follows it, but not
+   * what follows a page break after it, so drawing the document in order and
+   * in parallel segments gives the same pages
+   */
+  char text[2048] = "";
+  for (int i = 0; i < 40; i++) {
+    strcat(text, "Text that flows onto the next page. ");
+  }
+  cJSON *content = cJSON_CreateObject();
+  cJSON_AddStringToObject(content, "paragraph", text);
+  cJSON_AddStringToObject(content, "pageBreak", "");
+  cJSON_AddStringToObject(content, "after", "After the break");
+  stylesheet = cJSON_Parse(
+      "{\"_options\": {\"pageWidth\": 200, \"pageHeight\": 200, \"pageMargin\": 20, "
+      "\"flow\": 1}, \"paragraph\": {\"_style\": {\"x\": 20, \"y\": 100, \"width\": 160}}, "
+      "\"after\": {\"_style\": {\"x\": 20, \"y\": 100}}}");
+  indexTree(content);
+  indexTree(stylesheet);
+  L = newLuaState();
+  collectConstants(stylesheet, L);
+  memset(&options, 0, sizeof(options));
+  applyOptions(stylesheet, L, &options);
+  compileUsedStyles(content, stylesheet, L);
+  pageList serial = {0};
+  pageList parallel = {0};
+  recordDocument(&serial, content, stylesheet, L, &options, 1);
+  recordDocument(&parallel, content, stylesheet, L, &options, 2);
+  assert(serial.count >= 3);
+  assert(samePages(&serial, &parallel, 200, 200));
+  freePages(&serial);
+  freePages(&parallel);
+  lua_close(L);
+  cJSON_Delete(content);
+  cJSON_Delete(stylesheet);
+  freeRenderCaches();
+  freeStyleRecords();
+  freeIndex();
+  clearConstants();
+
+  /*
+   * Fetch one icon that exists and one that does not, concurrently
+   */
+  char source[PATH_MAX];
+  char present[PATH_MAX + 16];
+  assert(realpath("example/test/lipsum.txt", source));
+  snprintf(present, sizeof(present), "file://%s", source);
+  unlink("build/fetched.txt");
+  unlink("build/missing.txt");
+  stylesheet = cJSON_CreateObject();
+  cJSON *icon = cJSON_AddObjectToObject(cJSON_AddObjectToObject(stylesheet, "present"), "icon");
+  cJSON_AddStringToObject(icon, "url", present);
+  cJSON_AddStringToObject(icon, "name", "build/fetched.txt");
+  icon = cJSON_AddObjectToObject(cJSON_AddObjectToObject(stylesheet, "missing"), "icon");
+  cJSON_AddStringToObject(icon, "url", "file:///nonexistent/missing.txt");
+  cJSON_AddStringToObject(icon, "name", "build/missing.txt");
+  fetchOptions fetch = {0};
+  fetch.connections = FETCH_CONNECTIONS;
+  fetch.timeout = FETCH_TIMEOUT;
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  assert(prefetchIcons(NULL, stylesheet, &fetch) == 1);
+  curl_global_cleanup();
+  assert(access("build/missing.txt", F_OK) != 0);
+
+  inputFile expected;
+  inputFile fetched;
+  f = fopen("example/test/lipsum.txt", "rb");
+  mapFile(f, &expected);
+  fclose(f);
+  f = fopen("build/fetched.txt", "rb");
+  assert(f);
+  mapFile(f, &fetched);
+  fclose(f);
+  assert(fetched.size == expected.size && memcmp(fetched.data, expected.data, expected.size) == 0);
+  unmapFile(&expected);
+  unmapFile(&fetched);
+  cJSON_Delete(stylesheet);
 }
@@ -1,17 +1,32 @@
+#include <cairo-pdf.h>
 #include <cjson/cJSON.h>
+#include <lauxlib.h>
 #include <librsvg-2.0/librsvg/rsvg.h>
 
+#include "index.h"
+#include "lua.h"
+#include "memo.h"
+#include "pages.h"
+#include "profile.h"
 #include "render.h"
+#include "stream.h"
 #include "style.h"
 #include "traverse.h"
 
 /*
- * Checks a node and all of its siblings for a particular key string.
+ * Checks a node and all of its siblings for a particular key string. Trees that
+ * have been indexed are looked up through their hash tables instead.
  */
 cJSON *find(cJSON *tree, char *str) {
   cJSON *node = NULL;
 
+  if (profiling) {
+    countEvent(COUNT_FINDS);
+  }
   if (tree) {
+    if (lookupIndex(tree, str, &node)) {
+      return node;
+    }
     node = tree->child;
     while (1) {
       if (!node) {
@@ -26,71 +41,304 @@ cJSON *find(cJSON *tree, char *str) {
   return node;
 }
 
+float _simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, int depth,
+                              struct style style, lua_State *L, int logMode);
+
 /*
- * This function traverses the content and stylesheet trees simultaneously and
- * applies style information and draws elements along the way.
+ * Traverse a single child, following along in the matching stylesheet node.
+ * Returns how far text in it flowed the elements after it down the page, since
+ * the last page break in it.
  */
-void _simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, int depth,
-                             struct style style, lua_State *L, int logMode) {
+static float traverseChild(cairo_t *cr, cJSON *contentNode, cJSON *stylesheet, int depth,
+                          struct style style, lua_State *L, int logMode) {
+  if (logMode == LOG_VERBOSE) {
+    fprintf(stdout, "Processing node: ");
+    for (int i = 0; i < depth; i++) {
+      fprintf(stdout, "  ");
+    }
+    fprintf(stdout, "%s\n", contentNode->string);
+  }
 
-  cJSON *styleElement = find(stylesheet, "_style");
-  applyStyles(cr, styleElement, &style, L);
+  /*
+   * Find the correct node in the stylesheet to follow along
+   */
+  cJSON *styleNode = find(stylesheet, contentNode->string);
 
-  handleImages(cr, stylesheet, &style);
+  /*
+   * Recur
+   */
+  if (profiling) {
+    enterNode(contentNode->string);
+  }
+  float shift = _simultaneous_traversal(cr, contentNode, styleNode, depth + 1, style, L, logMode);
+  if (profiling) {
+    leaveNode();
+  }
+  return shift;
+}
+
+/*
+ * Traverse the children of a node from index `first` up to, but not including,
+ * index `last`. A negative `last` means all remaining children. Children that
+ * are skipped still shift the position of the ones that follow, and so does
+ * text that flows onto new pages, up to the next page break. Returns the shift
+ * from flowing text since the last page break.
+ */
+static float traverseChildren(cairo_t *cr, cJSON *content, cJSON *stylesheet, int depth,
+                             struct style style, const styleRecord *record, lua_State *L,
+                             int logMode, int first, int last) {
 
-  renderText(cr, content, &style);
+  /*
+   * The offsets that successive children are shifted by
+   */
+  float xOffset = 0;
+  float yOffset = 0;
+  if (record) {
+    xOffset = record->xOffset;
+    yOffset = record->yOffset;
+  }
 
   cJSON *contentNode = content->child;
+  float shift = 0;
 
   /*
    * Traverse the children
    */
-  while (1) {
-    if (!contentNode) {
+  for (int index = 0; contentNode; index++) {
+    if (last >= 0 && index >= last) {
       break;
     }
-    if (logMode == LOG_VERBOSE) {
-      fprintf(stdout, "Processing node: ");
-      for (int i = 0; i < depth; i++) {
-        fprintf(stdout, "  ");
+    if (index >= first) {
+      unsigned long breaks = getPageBreaks();
+      float flowed = traverseChild(cr, contentNode, stylesheet, depth, style, L, logMode);
+      if (getPageBreaks() != breaks) {
+        style.y -= shift;
+        shift = 0;
       }
-      fprintf(stdout, "%s\n", contentNode->string);
+      style.y += flowed;
+      shift += flowed;
     }
 
-    /*
-     * Find the correct node in the stylesheet to follow along
-     */
-    cJSON *styleNode = find(stylesheet, contentNode->string);
-
-    /*
-     * Recur
-     */
-    _simultaneous_traversal(cr, contentNode, styleNode, depth + 1, style, L, logMode);
-
-    cJSON *styleElement = find(stylesheet, "_style");
-    if (styleElement) {
-      cJSON *x = find(styleElement, "xOffset");
-      if (x) {
-        style.x += x->valuedouble;
-      }
-      cJSON *y = find(styleElement, "yOffset");
-      if (y) {
-        style.y += y->valuedouble;
-      }
-    }
+    style.x += xOffset;
+    style.y += yOffset;
 
     contentNode = contentNode->next;
   }
+  return shift;
 }
 
-void simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, lua_State *L, int logMode) {
-  /*
-   * Apply default styling rules.
-   */
+/*
+ * Draw a node and everything below it. Returns how far text in it flowed the
+ * elements after it down the page, since the last page break in it.
+ */
+static float drawNode(cairo_t *cr, cJSON *content, cJSON *stylesheet, int depth,
+                     struct style style, lua_State *L, int logMode) {
+
+  const styleRecord *record = getStyleRecord(find(stylesheet, "_style"), L);
+  applyStyles(cr, record, &style);
+
+  handleImages(cr, stylesheet, &style);
+
+  float shift = renderText(cr, content, &style);
+  style.y += shift;
+
+  unsigned long breaks = getPageBreaks();
+  float flowed = traverseChildren(cr, content, stylesheet, depth, style, record, L, logMode, 0, -1);
+  return (getPageBreaks() != breaks ? 0 : shift) + flowed;
+}
+
+/*
+ * This function traverses the content and stylesheet trees simultaneously and
+ * applies style information and draws elements along the way. A subtree that
+ * has already been drawn with the same stylesheet node and style is replayed
+ * from a recording instead, unless text may flow onto new pages. Returns how
+ * far flowing text moved the elements after it down the page, since the last
+ * page break.
+ */
+float _simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, int depth,
+                              struct style style, lua_State *L, int logMode) {
+  subtree *memo = NULL;
+  if (depth > 0 && !isFlowing() && cJSON_IsObject(content) && content->child) {
+    memo = findSubtree(content, stylesheet, &style);
+  }
+  if (memo) {
+    if (replaySubtree(cr, memo, style.x, style.y)) {
+      return 0;
+    }
+    cairo_t *recording = recordSubtree(memo);
+    if (recording) {
+      struct style origin = style;
+      origin.x = 0;
+      origin.y = 0;
+      drawNode(recording, content, stylesheet, depth, origin, L, logMode);
+      finishSubtree(memo, recording);
+      replaySubtree(cr, memo, style.x, style.y);
+      return 0;
+    }
+  }
+
+  return drawNode(cr, content, stylesheet, depth, style, L, logMode);
+}
+
+/*
+ * Apply default styling rules.
+ */
+static struct style defaultStyle() {
   struct style style = {0};
   style.size = 12;
   style.a = 1;
   style.lineHeight = 1.5;
-  strcpy(style.face, "Sans");
-  _simultaneous_traversal(cr, content, stylesheet, 0, style, L, logMode);
+  style.face = "Sans";
+  style.uri = "";
+  return style;
+}
+
+void simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, lua_State *L, int logMode) {
+  _simultaneous_traversal(cr, content, stylesheet, 0, defaultStyle(), L, logMode);
+}
+
+/*
+ * Traverse only the children of the root from index `first` up to `last`, with
+ * the same style they would have in a full traversal. This lets a document be
+ * split into pieces that are rendered independently. Only the piece that
+ * starts at the first child draws the root element itself. A "pageBreak"
+ * element at the end of the piece is drawn without breaking the page, which
+ * is left to whoever puts the pieces together.
+ */
+void traverse_range(cairo_t *cr, cJSON *content, cJSON *stylesheet, lua_State *L,
+                    int logMode, int first, int last) {
+  cJSON *end = last > 0 ? cJSON_GetArrayItem(content, last - 1) : NULL;
+  holdPageBreak(end && isPageBreak(end) ? end : NULL);
+
+  struct style style = defaultStyle();
+  const styleRecord *record = getStyleRecord(find(stylesheet, "_style"), L);
+  if (first == 0) {
+    applyStyles(cr, record, &style);
+    handleImages(cr, stylesheet, &style);
+  } else {
+    inheritStyles(record, &style);
+  }
+  traverseChildren(cr, content, stylesheet, 0, style, record, L, logMode, first, last);
+  holdPageBreak(NULL);
+}
+
+/*
+ * Traverse a document whose root children are read one at a time from a
+ * stream. Each child is freed as soon as it has been drawn, so only one of
+ * them is in memory at once.
+ */
+void traverse_stream(cairo_t *cr, contentStream *stream, cJSON *stylesheet, lua_State *L,
+                     int logMode) {
+  struct style style = defaultStyle();
+  const styleRecord *record = getStyleRecord(find(stylesheet, "_style"), L);
+  applyStyles(cr, record, &style);
+  handleImages(cr, stylesheet, &style);
+
+  /*
+   * The offsets that successive children are shifted by
+   */
+  float xOffset = 0;
+  float yOffset = 0;
+  if (record) {
+    xOffset = record->xOffset;
+    yOffset = record->yOffset;
+  }
+
+  /*
+   * Text that flows onto new pages moves everything after it, up to the next
+   * page break
+   */
+  float shift = 0;
+  cJSON *contentNode;
+  while ((contentNode = nextMember(stream))) {
+    unsigned long breaks = getPageBreaks();
+    digestRecord(contentNode);
+    float flowed = traverseChild(cr, contentNode, stylesheet, 0, style, L, logMode);
+    digestRecord(NULL);
+    if (getPageBreaks() != breaks) {
+      style.y -= shift;
+      shift = 0;
+    }
+    style.y += flowed;
+    shift += flowed;
+    cJSON_Delete(contentNode);
+    style.x += xOffset;
+    style.y += yOffset;
+  }
+}
+
+/*
+ * Create the PDF surface for a document, and a context to draw on it. Returns
+ * NULL if the file could not be created.
+ */
+static cairo_t *openDocument(const char *filename, options *options) {
+  cairo_surface_t *surface = cairo_pdf_surface_create(
+      filename, options->pageWidth, options->pageHeight);
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy(surface);
+    return NULL;
+  }
+  cairo_t *cr = cairo_create(surface);
+  cairo_surface_destroy(surface);
+  setPageFlow(options);
+  return cr;
+}
+
+/*
+ * Finish the last page and write out the document. Any earlier pages were
+ * ended by "pageBreak" elements. Returns -1 if the file could not be written
+ * in full.
+ */
+static int closeDocument(cairo_t *cr) {
+  beginPhase(PHASE_WRITE);
+  cairo_show_page(cr);
+  cairo_surface_t *surface = cairo_get_target(cr);
+  cairo_surface_finish(surface);
+  int status = cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS ? 0 : -1;
+  cairo_destroy(cr);
+  endPhase(PHASE_WRITE);
+  return status;
+}
+
+/*
+ * Render a complete document to a PDF file. Returns zero on success, or -1 if
+ * the file could not be created or written.
+ */
+int renderDocument(const char *filename, cJSON *content, cJSON *stylesheet,
+                   lua_State *L, options *options, int jobs, int logMode) {
+  cairo_t *cr = openDocument(filename, options);
+  if (!cr) {
+    return -1;
+  }
+  beginPhase(PHASE_RENDER);
+
+  /*
+   * Render pages in parallel if allowed and the document can be split,
+   * otherwise in order
+   */
+  if (jobs < 2 || renderPages(cr, content, stylesheet, options, jobs, logMode)) {
+    simultaneous_traversal(cr, content, stylesheet, L, logMode);
+  }
+
+  int status = closeDocument(cr);
+  endPhase(PHASE_RENDER);
+  return status;
+}
+
+/*
+ * Render a document to a PDF file while reading its content from a stream.
+ * Pages are written out as they are finished. Returns zero on success, or -1
+ * if the file could not be created or written.
+ */
+int renderStream(const char *filename, contentStream *stream, cJSON *stylesheet,
+                 lua_State *L, options *options, int logMode) {
+  cairo_t *cr = openDocument(filename, options);
+  if (!cr) {
+    return -1;
+  }
+  beginPhase(PHASE_RENDER);
+  traverse_stream(cr, stream, stylesheet, L, logMode);
+  int status = closeDocument(cr);
+  endPhase(PHASE_RENDER);
+  return status;
 }
@@ -1,10 +1,21 @@
 #ifndef TRAVERSE_H
 #define TRAVERSE_H
 
+struct options;
+struct contentStream;
+
 enum { LOG_NONE = 0,
        LOG_VERBOSE = 1 };
 
 cJSON *find(cJSON *tree, char *str);
 void simultaneous_traversal(cairo_t *cr, cJSON *content, cJSON *stylesheet, lua_State *L, int logMode);
+void traverse_range(cairo_t *cr, cJSON *content, cJSON *stylesheet, lua_State *L,
+                    int logMode, int first, int last);
+void traverse_stream(cairo_t *cr, struct contentStream *stream, cJSON *stylesheet,
+                     lua_State *L, int logMode);
+int renderDocument(const char *filename, cJSON *content, cJSON *stylesheet,
+                   lua_State *L, struct options *options, int jobs, int logMode);
+int renderStream(const char *filename, struct contentStream *stream, cJSON *stylesheet,
+                 lua_State *L, struct options *options, int logMode);
 
 #endif
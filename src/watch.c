@@ -0,0 +1,536 @@
+#include <cairo-pdf.h>
+#include <cjson/cJSON.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dsml2.h"
+#include "expr.h"
+#include "fetch.h"
+#include "image.h"
+#include "index.h"
+#include "io.h"
+#include "lua.h"
+#include "memo.h"
+#include "pages.h"
+#include "render.h"
+#include "style.h"
+#include "traverse.h"
+#include "watch.h"
+
+/*
+ * Editors often write a file in several steps, so events are collected until
+ * none have arrived for this many milliseconds before rebuilding.
+ */
+#define WATCH_SETTLE_MS 50
+
+/*
+ * A file that triggers a rebuild when it changes. Directories are watched
+ * rather than files, so that files replaced by a rename are still noticed.
+ */
+typedef struct watchedFile {
+  int wd;
+  char *path;
+  const char *name;
+} watchedFile;
+
+/*
+ * The pages that a segment rendered to in the previous build, and a hash of
+ * everything that they depend on.
+ */
+typedef struct cachedSegment {
+  unsigned long key;
+  int cacheable;
+  pageList pages;
+} cachedSegment;
+
+/*
+ * Everything that is kept from one build to the next.
+ */
+typedef struct document {
+  const char *contentPath;
+  const char *stylesheetPath;
+  const char *outputPath;
+  const fetchOptions *fetch;
+  int logMode;
+  cJSON *content;
+  cJSON *stylesheet;
+  char *constants;
+  lua_State *L;
+  options options;
+  unsigned int contentChecksum;
+  unsigned int stylesheetChecksum;
+  unsigned long resources;
+  cachedSegment *segments;
+  int segmentCount;
+  int inotify;
+  watchedFile *files;
+  int fileCount;
+  int fileSize;
+} document;
+
+static unsigned long hashBytes(unsigned long hash, const void *p, size_t length) {
+  const unsigned char *s = p;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= s[i];
+    hash *= 1099511628211UL;
+  }
+  return hash;
+}
+
+static unsigned long hashString(unsigned long hash, const char *s) {
+  return hashBytes(hash, s, strlen(s) + 1);
+}
+
+/*
+ * Start watching a file, unless it is already watched.
+ */
+static void watchFile(document *doc, const char *path) {
+  for (int i = 0; i < doc->fileCount; i++) {
+    if (strcmp(doc->files[i].path, path) == 0) {
+      return;
+    }
+  }
+
+  const char *slash = strrchr(path, '/');
+  char *directory = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+  if (!directory) {
+    fprintf(stderr, "Could not allocate watch list.\n");
+    exit(EXIT_FAILURE);
+  }
+  int wd = inotify_add_watch(doc->inotify, directory,
+                             IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ATTRIB);
+  if (wd < 0) {
+    fprintf(stderr, "Could not watch \"%s\".\n", directory);
+    perror("inotify_add_watch");
+    free(directory);
+    return;
+  }
+  free(directory);
+
+  if (doc->fileCount == doc->fileSize) {
+    doc->fileSize = doc->fileSize ? doc->fileSize * 2 : 8;
+    doc->files = realloc(doc->files, doc->fileSize * sizeof(watchedFile));
+    if (!doc->files) {
+      fprintf(stderr, "Could not allocate watch list.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  watchedFile *file = &doc->files[doc->fileCount++];
+  file->wd = wd;
+  file->path = strdup(path);
+  slash = strrchr(file->path, '/');
+  file->name = slash ? slash + 1 : file->path;
+}
+
+/*
+ * Hash the modification time and size of a file that the output depends on,
+ * and watch it.
+ */
+static unsigned long hashFile(document *doc, unsigned long hash, const char *path) {
+  struct stat st;
+  watchFile(doc, path);
+  hash = hashString(hash, path);
+  if (stat(path, &st) == 0) {
+    hash = hashBytes(hash, &st.st_mtim, sizeof(st.st_mtim));
+    hash = hashBytes(hash, &st.st_size, sizeof(st.st_size));
+  }
+  return hash;
+}
+
+/*
+ * Hash the images that the stylesheet draws, so that pages are drawn again
+ * when one of them changes.
+ */
+static unsigned long hashResources(document *doc, cJSON *tree, unsigned long hash) {
+  for (cJSON *node = tree->child; node; node = node->next) {
+    if (!cJSON_IsObject(node)) {
+      continue;
+    }
+    cJSON *file = NULL;
+    if (strcmp(node->string, "png") == 0) {
+      file = find(node, "filename");
+    } else if (strcmp(node->string, "icon") == 0) {
+      file = find(node, "name");
+    }
+    if (cJSON_IsString(file)) {
+      hash = hashFile(doc, hash, file->valuestring);
+    }
+    hash = hashResources(doc, node, hash);
+  }
+  return hash;
+}
+
+/*
+ * Hash a content node and everything below it. Text that is replaced at render
+ * time is hashed together with what it depends on. Returns zero if the node
+ * can never be reused, which is the case for the current date.
+ */
+static int hashNode(document *doc, cJSON *node, unsigned long *hash) {
+  *hash = hashString(*hash, node->string ? node->string : "");
+  *hash = hashBytes(*hash, &node->type, sizeof(node->type));
+
+  if (cJSON_IsString(node)) {
+    const char *s = node->valuestring;
+    *hash = hashString(*hash, s);
+    if (strcmp(s, "CURRENT_DATE") == 0) {
+      return 0;
+    }
+    if (strcmp(s, "REV") == 0) {
+      *hash = hashBytes(*hash, &doc->contentChecksum, sizeof(doc->contentChecksum));
+    }
+    if (strncmp(s, "INCLUDE:", strlen("INCLUDE:")) == 0) {
+      *hash = hashFile(doc, *hash, s + strlen("INCLUDE:"));
+    }
+  } else if (cJSON_IsNumber(node)) {
+    *hash = hashBytes(*hash, &node->valuedouble, sizeof(node->valuedouble));
+  }
+
+  int cacheable = 1;
+  for (cJSON *child = node->child; child; child = child->next) {
+    cacheable &= hashNode(doc, child, hash);
+  }
+  return cacheable;
+}
+
+static cJSON *readDocumentFile(const char *path, unsigned int *checksum) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Trying to open \"%s\".\n", path);
+    perror("fopen");
+    return NULL;
+  }
+  inputFile input;
+  mapFile(f, &input);
+  fclose(f);
+  *checksum = checksumData(&input);
+  cJSON *tree = tryParseJSON(&input);
+  unmapFile(&input);
+  return tree;
+}
+
+/*
+ * Read and prepare both files. The constants are only evaluated again, in a
+ * fresh Lua state, if the "_constants" element has changed; otherwise the Lua
+ * state and its compiled expressions are kept. Returns -1, keeping the
+ * previous document, if either file cannot be read.
+ */
+static int loadDocument(document *doc) {
+  unsigned int contentChecksum;
+  unsigned int stylesheetChecksum;
+  cJSON *stylesheet = readDocumentFile(doc->stylesheetPath, &stylesheetChecksum);
+  cJSON *content = stylesheet ? readDocumentFile(doc->contentPath, &contentChecksum) : NULL;
+  if (!content) {
+    cJSON_Delete(stylesheet);
+    return -1;
+  }
+
+  /*
+   * The keys of the old trees point into the index, so it can only be rebuilt
+   * once they are gone
+   */
+  cJSON_Delete(doc->content);
+  cJSON_Delete(doc->stylesheet);
+  freeStyleRecords();
+  freeIndex();
+  doc->content = content;
+  doc->stylesheet = stylesheet;
+  doc->contentChecksum = contentChecksum;
+  doc->stylesheetChecksum = stylesheetChecksum;
+  setContentChecksum(contentChecksum);
+  setStylesheetChecksum(stylesheetChecksum);
+
+  /*
+   * Icons are cached by name, and may have changed on disk
+   */
+  freeIcons();
+
+  foldNumbers(stylesheet);
+  indexTree(content);
+  indexTree(stylesheet);
+  digestTrees(content, stylesheet);
+
+  /*
+   * Drafts only draw placeholders, so icons are never fetched for them
+   */
+  int failures = draft ? 0 : prefetchIcons(content, stylesheet, doc->fetch);
+  if (failures) {
+    fprintf(stderr, "%d icons could not be fetched.\n", failures);
+  }
+
+  cJSON *constants = find(stylesheet, "_constants");
+  char *printed = constants ? cJSON_PrintUnformatted(constants) : NULL;
+  if (!doc->L || !printed != !doc->constants ||
+      (printed && strcmp(printed, doc->constants) != 0)) {
+    if (doc->L) {
+      lua_close(doc->L);
+      if (doc->logMode == LOG_VERBOSE) {
+        fprintf(stdout, "Constants changed, evaluating them again.\n");
+      }
+    }
+    clearConstants();
+    freeSubtrees();
+    doc->L = newLuaState();
+    collectConstants(stylesheet, doc->L);
+  }
+  cJSON_free(doc->constants);
+  doc->constants = printed;
+
+  memset(&doc->options, 0, sizeof(doc->options));
+  doc->options.pageWidth = 8.5 * POINTS_PER_INCH;
+  doc->options.pageHeight = 11 * POINTS_PER_INCH;
+  applyOptions(stylesheet, doc->L, &doc->options);
+  compileUsedStyles(content, stylesheet, doc->L);
+  return 0;
+}
+
+static void freeSegments(cachedSegment *segments, int count) {
+  for (int i = 0; i < count; i++) {
+    freePages(&segments[i].pages);
+  }
+  free(segments);
+}
+
+/*
+ * Render the document to a temporary file beside the output, then move it
+ * into place, so that viewers never see a partial file. Pages are split at top
+ * level "pageBreak" elements, and a segment whose content and dependencies
+ * hash the same as in the previous build replays the pages it drew then.
+ * Returns the number of segments drawn, or -1 if the output could not be
+ * written.
+ */
+static int buildDocument(document *doc, int *total) {
+  char temporary[4096];
+  snprintf(temporary, sizeof(temporary), "%s.XXXXXX", doc->outputPath);
+  int fd = makeTemporary(temporary);
+  if (fd < 0) {
+    perror("mkstemp");
+    return -1;
+  }
+  close(fd);
+
+  int count = 0;
+  segment *segments = cJSON_IsObject(doc->content) ? splitPages(doc->content, &count) : NULL;
+  cachedSegment *built = calloc(count ? count : 1, sizeof(cachedSegment));
+  if (!built) {
+    fprintf(stderr, "Could not allocate page segments.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Hash each segment. A segment's style depends on its position as well as
+   * its content.
+   */
+  unsigned long resources = hashResources(doc, doc->stylesheet, 14695981039346656037UL);
+  unsigned long base = hashBytes(resources, &doc->stylesheetChecksum,
+                                 sizeof(doc->stylesheetChecksum));
+
+  /*
+   * Recorded subtrees are keyed by their content and style, but not by the
+   * images they draw
+   */
+  if (resources != doc->resources) {
+    freeSubtrees();
+    doc->resources = resources;
+  }
+  for (int i = 0; i < count; i++) {
+    unsigned long key = hashBytes(base, &segments[i].first, sizeof(segments[i].first));
+    int cacheable = 1;
+    int index = 0;
+    for (cJSON *node = doc->content->child; node && index < segments[i].last; node = node->next, index++) {
+      if (index >= segments[i].first) {
+        cacheable &= hashNode(doc, node, &key);
+      }
+    }
+    built[i].key = key;
+    built[i].cacheable = cacheable;
+  }
+
+  int drawn = 0;
+  int status = 0;
+  *total = count;
+  if (!segments || usesLinks(doc->stylesheet)) {
+
+    /*
+     * Links are lost when recorded pages are replayed, so the whole document
+     * is drawn every time
+     */
+    if (renderDocument(temporary, doc->content, doc->stylesheet, doc->L, &doc->options, 1,
+                       doc->logMode)) {
+      unlink(temporary);
+      freeSegments(built, count);
+      free(segments);
+      return -1;
+    }
+    drawn = count;
+  } else {
+    for (int i = 0; i < count; i++) {
+      for (int j = 0; j < doc->segmentCount; j++) {
+        cachedSegment *old = &doc->segments[j];
+        if (built[i].cacheable && old->cacheable && old->key == built[i].key) {
+          built[i].pages = old->pages;
+          memset(&old->pages, 0, sizeof(pageList));
+          old->cacheable = 0;
+          break;
+        }
+      }
+      if (!built[i].pages.pages) {
+        recordSegment(&segments[i], doc->content, doc->stylesheet, doc->L, &doc->options,
+                      doc->logMode);
+        built[i].pages = segments[i].pages;
+        drawn++;
+      }
+    }
+
+    cairo_surface_t *surface = cairo_pdf_surface_create(temporary, doc->options.pageWidth,
+                                                        doc->options.pageHeight);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+      cairo_surface_destroy(surface);
+      unlink(temporary);
+      freeSegments(built, count);
+      free(segments);
+      return -1;
+    }
+    cairo_t *cr = cairo_create(surface);
+    int first = 1;
+    for (int i = 0; i < count; i++) {
+      replayPages(cr, &built[i].pages, &first);
+    }
+    cairo_show_page(cr);
+    cairo_destroy(cr);
+
+    /*
+     * A failed write, such as a full disk, must never replace the last good
+     * output
+     */
+    cairo_surface_finish(surface);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+      status = -1;
+    }
+    cairo_surface_destroy(surface);
+  }
+  free(segments);
+  trimSubtrees();
+
+  freeSegments(doc->segments, doc->segmentCount);
+  doc->segments = built;
+  doc->segmentCount = count;
+
+  if (status != 0) {
+    unlink(temporary);
+    return -1;
+  }
+  if (rename(temporary, doc->outputPath) != 0) {
+    perror("rename");
+    unlink(temporary);
+    return -1;
+  }
+  return drawn;
+}
+
+/*
+ * Read pending events. Returns non-zero if any of them concern a watched file,
+ * or if the queue overflowed and events were lost.
+ */
+static int readEvents(document *doc) {
+  _Alignas(struct inotify_event) char buffer[4096];
+  ssize_t length = read(doc->inotify, buffer, sizeof(buffer));
+  if (length <= 0) {
+    return 0;
+  }
+
+  int relevant = 0;
+  for (char *p = buffer; p < buffer + length;) {
+    struct inotify_event *event = (struct inotify_event *)p;
+
+    /*
+     * Events were dropped, so any file may have changed
+     */
+    if (event->mask & IN_Q_OVERFLOW) {
+      relevant = 1;
+    }
+    for (int i = 0; event->len && i < doc->fileCount; i++) {
+      if (doc->files[i].wd == event->wd && strcmp(doc->files[i].name, event->name) == 0) {
+        relevant = 1;
+      }
+    }
+    p += sizeof(struct inotify_event) + event->len;
+  }
+  return relevant;
+}
+
+static double millisecondsSince(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Render a document, then keep rendering it again whenever the content, the
+ * stylesheet, an included file or an image changes, until the process is
+ * interrupted. The Lua state, fonts, images, recorded subtrees and the pages
+ * of unchanged segments are kept between builds. Only returns if the first
+ * build fails.
+ */
+int watchDocument(const char *contentPath, const char *stylesheetPath, const char *outputPath,
+                  const fetchOptions *fetch, int logMode) {
+  document doc = {0};
+  doc.contentPath = contentPath;
+  doc.stylesheetPath = stylesheetPath;
+  doc.outputPath = outputPath;
+  doc.fetch = fetch;
+  doc.logMode = logMode;
+
+  doc.inotify = inotify_init1(IN_CLOEXEC);
+  if (doc.inotify < 0) {
+    perror("inotify_init1");
+    return EXIT_FAILURE;
+  }
+  watchFile(&doc, contentPath);
+  watchFile(&doc, stylesheetPath);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int total;
+  if (loadDocument(&doc) || buildDocument(&doc, &total) < 0) {
+    fprintf(stderr, "Could not build \"%s\".\n", outputPath);
+    return EXIT_FAILURE;
+  }
+  fprintf(stdout, "Built \"%s\" in %.1f ms. Watching for changes.\n", outputPath,
+          millisecondsSince(&start));
+
+  while (1) {
+    if (!readEvents(&doc)) {
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /*
+     * Let a burst of writes settle
+     */
+    struct pollfd p = {doc.inotify, POLLIN, 0};
+    while (poll(&p, 1, WATCH_SETTLE_MS) > 0) {
+      readEvents(&doc);
+    }
+
+    if (loadDocument(&doc)) {
+      fprintf(stderr, "Not rebuilt, keeping the previous document.\n");
+      continue;
+    }
+    int drawn = buildDocument(&doc, &total);
+    if (drawn < 0) {
+      fprintf(stderr, "Could not write \"%s\".\n", outputPath);
+      continue;
+    }
+    fprintf(stdout, "Rebuilt \"%s\" in %.1f ms (%d of %d page segments drawn).\n", outputPath,
+            millisecondsSince(&start), drawn, total);
+    fflush(stdout);
+  }
+}
@@ -0,0 +1,7 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+int watchDocument(const char *contentPath, const char *stylesheetPath, const char *outputPath,
+                  const fetchOptions *fetch, int logMode);
+
+#endif